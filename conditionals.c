@@ -1,9 +1,12 @@
 #include "mpc.h"
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 
@@ -22,14 +25,598 @@ void add_history(char *unused) {}
 
 #else
 #include <editline/readline.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 /* Forward Declarations */
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lseq;
+struct lmap;
+struct lstr;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lseq lseq;
+typedef struct lmap lmap;
+typedef struct lstr lstr;
+
+/* Managed Heap */
+
+/* Every lval, lenv, lcode, lseq, lmap and lstr lives in a slab cell behind an
+ * lhdr. Each kind of object has its own pool of slabs and free list, so
+ * allocation and release are a pointer swap. Reference counting frees
+ * most objects as soon as they become unused, the collector reclaims
+ * anything counting misses. */
+
+enum {
+  LOBJ_VAL,
+  LOBJ_ENV,
+  LOBJ_CODE,
+  LOBJ_SEQ,
+  LOBJ_MAP,
+  LOBJ_STR,
+  LOBJ_KINDS,
+  LOBJ_FREE = LOBJ_KINDS
+};
+
+typedef struct lhdr {
+  /* Next cell on the free list while the cell is unused */
+  struct lhdr *next;
+  int kind;
+  int mark;
+} lhdr;
+
+#define LHDR(p) ((lhdr *)(p)-1)
+
+/* Cells per slab */
+#define LSLAB_CELLS 256
+
+typedef struct lslab {
+  struct lslab *next;
+  /* Cells follow */
+} lslab;
+
+typedef struct lpool {
+  /* Bytes per cell, including the header */
+  size_t size;
+  lslab *slabs;
+  lhdr *free;
+
+  long nslabs;
+  long nfree;
+  long allocs;
+  long frees;
+} lpool;
+
+typedef struct lheap_stats {
+  long objects;
+  long bytes;
+  long collections;
+  long freed;
+  long last_pause_us;
+  long max_pause_us;
+  long total_pause_us;
+} lheap_stats;
+
+struct lheap {
+  lpool pools[LOBJ_KINDS];
+  lheap_stats stats;
+
+  /* Collect at the next safe point once 'bytes' passes this */
+  long threshold;
+  int requested;
+
+  /* Objects which are always live */
+  int nroots;
+  void **roots;
+};
+
+struct lheap lheap = {{{0}}, {0, 0, 0, 0, 0, 0, 0}, 1 << 20, 0, 0, NULL};
+
+#define LSLAB_CELL(p, s, i) ((lhdr *)((char *)((s) + 1) + (p)->size * (i)))
+
+void lpool_grow(lpool *p) {
+  lslab *s = malloc(sizeof(lslab) + p->size * LSLAB_CELLS);
+  s->next = p->slabs;
+  p->slabs = s;
+  p->nslabs++;
+
+  /* Thread the new cells onto the free list */
+  for (int i = LSLAB_CELLS - 1; i >= 0; i--) {
+    lhdr *h = LSLAB_CELL(p, s, i);
+    h->kind = LOBJ_FREE;
+    h->mark = 0;
+    h->next = p->free;
+    p->free = h;
+  }
+  p->nfree += LSLAB_CELLS;
+}
+
+void *lheap_alloc(int kind, size_t size) {
+  lpool *p = &lheap.pools[kind];
+  if (!p->size) {
+    /* Round cells up to keep objects 16 byte aligned */
+    p->size = (sizeof(lhdr) + size + 15) & ~(size_t)15;
+  }
+  if (!p->free) {
+    lpool_grow(p);
+  }
+
+  lhdr *h = p->free;
+  p->free = h->next;
+  p->nfree--;
+  p->allocs++;
+
+  h->kind = kind;
+  h->mark = 0;
+  lheap.stats.objects++;
+  lheap.stats.bytes += p->size;
+  return h + 1;
+}
+
+void lheap_free(void *obj) {
+  lhdr *h = LHDR(obj);
+  lpool *p = &lheap.pools[h->kind];
+  h->kind = LOBJ_FREE;
+  h->next = p->free;
+  p->free = h;
+  p->nfree++;
+  p->frees++;
+  lheap.stats.objects--;
+  lheap.stats.bytes -= p->size;
+}
+
+void lheap_add_root(void *obj) {
+  lheap.nroots++;
+  lheap.roots = realloc(lheap.roots, sizeof(void *) * lheap.nroots);
+  lheap.roots[lheap.nroots - 1] = obj;
+}
+
+void lheap_del_root(void *obj) {
+  for (int i = lheap.nroots - 1; i >= 0; i--) {
+    if (lheap.roots[i] == obj) {
+      lheap.roots[i] = lheap.roots[--lheap.nroots];
+      return;
+    }
+  }
+}
+
+void lheap_get_stats(lheap_stats *s) { *s = lheap.stats; }
+
+/* Symbol Table */
+
+/* Every distinct symbol name is stored once, so symbols can be compared
+ * and hashed by pointer. Interned names live until the program exits. */
+struct lsymtab {
+  int count;
+  int cap;
+  char **names;
+};
+
+struct lsymtab lsyms = {0, 0, NULL};
+
+/* Names the interpreter itself compares against */
+char *lsym_amp;
+char *lsym_def;
+char *lsym_put;
+
+unsigned long lsym_hash(char *s) {
+  /* FNV-1a */
+  unsigned long h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int lsym_slot(char **names, int cap, char *s) {
+  int mask = cap - 1;
+  int i = lsym_hash(s) & mask;
+  while (names[i] && strcmp(names[i], s) != 0) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+char *lsym(char *s) {
+  if (lsyms.cap) {
+    int i = lsym_slot(lsyms.names, lsyms.cap, s);
+    if (lsyms.names[i]) {
+      return lsyms.names[i];
+    }
+  }
+
+  /* Keep the table at most half full */
+  if ((lsyms.count + 1) * 2 > lsyms.cap) {
+    int cap = lsyms.cap ? lsyms.cap * 2 : 64;
+    char **names = calloc(cap, sizeof(char *));
+    for (int i = 0; i < lsyms.cap; i++) {
+      if (lsyms.names[i]) {
+        names[lsym_slot(names, cap, lsyms.names[i])] = lsyms.names[i];
+      }
+    }
+    free(lsyms.names);
+    lsyms.names = names;
+    lsyms.cap = cap;
+  }
+
+  int i = lsym_slot(lsyms.names, lsyms.cap, s);
+  lsyms.names[i] = malloc(strlen(s) + 1);
+  strcpy(lsyms.names[i], s);
+  lsyms.count++;
+  return lsyms.names[i];
+}
+
+void lsym_init(void) {
+  lsym_amp = lsym("&");
+  lsym_def = lsym("def");
+  lsym_put = lsym("=");
+}
+
+/* Bignums */
+
+/* Integers too large for a fixnum are kept as a sign and a magnitude of
+ * base 2^32 limbs, least significant first, with no leading zero limbs.
+ * Products of long operands are split in half, Karatsuba style, needing
+ * three half size products instead of four. */
+
+typedef struct lbig {
+  int neg;
+  int len;
+  uint32_t *mag;
+} lbig;
+
+/* Operands shorter than this many limbs are multiplied directly */
+#define LBIG_KARATSUBA 32
+
+/* Length of 'a' without leading zero limbs */
+int lmag_trim(uint32_t *a, int n) {
+  while (n > 0 && a[n - 1] == 0) {
+    n--;
+  }
+  return n;
+}
+
+int lmag_cmp(uint32_t *a, int na, uint32_t *b, int nb) {
+  na = lmag_trim(a, na);
+  nb = lmag_trim(b, nb);
+  if (na != nb) {
+    return na < nb ? -1 : 1;
+  }
+  for (int i = na - 1; i >= 0; i--) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* Add 'b' into 'r' in place, 'r' being long enough for the result */
+void lmag_addto(uint32_t *r, int nr, uint32_t *b, int nb) {
+  uint64_t c = 0;
+  int i = 0;
+  for (; i < nb; i++) {
+    c += (uint64_t)r[i] + b[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  for (; c && i < nr; i++) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+}
+
+/* Subtract 'b' from 'r' in place, 'r' being at least 'b' */
+void lmag_subfrom(uint32_t *r, int nr, uint32_t *b, int nb) {
+  uint64_t borrow = 0;
+  int i = 0;
+  for (; i < nb; i++) {
+    uint64_t d = (uint64_t)r[i] - b[i] - borrow;
+    r[i] = (uint32_t)d;
+    borrow = d >> 63;
+  }
+  for (; borrow && i < nr; i++) {
+    uint64_t d = (uint64_t)r[i] - borrow;
+    r[i] = (uint32_t)d;
+    borrow = d >> 63;
+  }
+}
+
+/* Multiply 'a' by 'm' and add 'c' in place, returning the carry out */
+uint32_t lmag_muladd(uint32_t *a, int na, uint32_t m, uint32_t c) {
+  uint64_t t = c;
+  for (int i = 0; i < na; i++) {
+    t += (uint64_t)a[i] * m;
+    a[i] = (uint32_t)t;
+    t >>= 32;
+  }
+  return (uint32_t)t;
+}
+
+/* Divide 'a' by 'd' into 'q', returning the remainder */
+uint32_t lmag_divsmall(uint32_t *q, uint32_t *a, int na, uint32_t d) {
+  uint64_t rem = 0;
+  for (int i = na - 1; i >= 0; i--) {
+    uint64_t cur = (rem << 32) | a[i];
+    q[i] = (uint32_t)(cur / d);
+    rem = cur % d;
+  }
+  return (uint32_t)rem;
+}
+
+/* r[0..na+nb) = a * b, where 'r' overlaps neither operand */
+void lmag_mul(uint32_t *r, uint32_t *a, int na, uint32_t *b, int nb) {
+  if (na < nb) {
+    uint32_t *t = a;
+    a = b;
+    b = t;
+    int n = na;
+    na = nb;
+    nb = n;
+  }
+  memset(r, 0, sizeof(uint32_t) * (na + nb));
+
+  /* Schoolbook multiplication */
+  if (nb < LBIG_KARATSUBA) {
+    for (int i = 0; i < nb; i++) {
+      uint64_t c = 0;
+      for (int j = 0; j < na; j++) {
+        c += (uint64_t)b[i] * a[j] + r[i + j];
+        r[i + j] = (uint32_t)c;
+        c >>= 32;
+      }
+      r[i + na] = (uint32_t)c;
+    }
+    return;
+  }
+
+  /* Very unbalanced, multiply by 'b' a slice of 'a' at a time */
+  if (na >= 2 * nb) {
+    uint32_t *t = malloc(sizeof(uint32_t) * 2 * nb);
+    for (int i = 0; i < na; i += nb) {
+      int n = na - i < nb ? na - i : nb;
+      lmag_mul(t, a + i, n, b, nb);
+      lmag_addto(r + i, na + nb - i, t, n + nb);
+    }
+    free(t);
+    return;
+  }
+
+  /* With a = a1 B^m + a0 and b = b1 B^m + b0 the middle term of the
+   * product is (a0 + a1)(b0 + b1) - a0 b0 - a1 b1 */
+  int m = na / 2;
+  int ns = na - m + 1;
+  uint32_t *sa = calloc(ns, sizeof(uint32_t));
+  uint32_t *sb = calloc(ns, sizeof(uint32_t));
+  memcpy(sa, a, sizeof(uint32_t) * m);
+  memcpy(sb, b, sizeof(uint32_t) * m);
+  lmag_addto(sa, ns, a + m, na - m);
+  lmag_addto(sb, ns, b + m, nb - m);
+
+  uint32_t *mid = malloc(sizeof(uint32_t) * 2 * ns);
+  lmag_mul(mid, sa, ns, sb, ns);
+  lmag_mul(r, a, m, b, m);
+  lmag_mul(r + 2 * m, a + m, na - m, b + m, nb - m);
+  lmag_subfrom(mid, 2 * ns, r, 2 * m);
+  lmag_subfrom(mid, 2 * ns, r + 2 * m, na + nb - 2 * m);
+  lmag_addto(r + m, na + nb - m, mid, lmag_trim(mid, 2 * ns));
+
+  free(sa);
+  free(sb);
+  free(mid);
+}
+
+/* q[0..na-nb] = a / b by Knuth's Algorithm D, for 'b' of at least two
+ * limbs with no leading zeros and 'a' at least as long */
+void lmag_div(uint32_t *q, uint32_t *a, int na, uint32_t *b, int nb) {
+
+  /* Normalise so the top limb of the divisor has its high bit set */
+  int s = 0;
+  while (!((b[nb - 1] << s) & 0x80000000u)) {
+    s++;
+  }
+  uint32_t *u = malloc(sizeof(uint32_t) * (na + 1));
+  uint32_t *v = malloc(sizeof(uint32_t) * nb);
+  u[na] = 0;
+  memcpy(u, a, sizeof(uint32_t) * na);
+  memcpy(v, b, sizeof(uint32_t) * nb);
+  if (s) {
+    u[na] = u[na - 1] >> (32 - s);
+    for (int i = na - 1; i > 0; i--) {
+      u[i] = (u[i] << s) | (u[i - 1] >> (32 - s));
+    }
+    u[0] <<= s;
+    for (int i = nb - 1; i > 0; i--) {
+      v[i] = (v[i] << s) | (v[i - 1] >> (32 - s));
+    }
+    v[0] <<= s;
+  }
+
+  for (int j = na - nb; j >= 0; j--) {
+
+    /* Estimate the quotient limb from the top two limbs, then correct */
+    uint64_t num = ((uint64_t)u[j + nb] << 32) | u[j + nb - 1];
+    uint64_t qhat = num / v[nb - 1];
+    uint64_t rhat = num % v[nb - 1];
+    while (qhat >> 32 ||
+           qhat * v[nb - 2] > ((rhat << 32) | u[j + nb - 2])) {
+      qhat--;
+      rhat += v[nb - 1];
+      if (rhat >> 32) {
+        break;
+      }
+    }
+
+    /* Multiply and subtract */
+    int64_t k = 0;
+    int64_t t;
+    for (int i = 0; i < nb; i++) {
+      uint64_t p = qhat * v[i];
+      t = (int64_t)u[i + j] - k - (int64_t)(p & 0xFFFFFFFFu);
+      u[i + j] = (uint32_t)t;
+      k = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)u[j + nb] - k;
+    u[j + nb] = (uint32_t)t;
+
+    /* The estimate was one too large, add the divisor back */
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t c = 0;
+      for (int i = 0; i < nb; i++) {
+        c += (uint64_t)u[i + j] + v[i];
+        u[i + j] = (uint32_t)c;
+        c >>= 32;
+      }
+      u[j + nb] += (uint32_t)c;
+    }
+  }
+
+  free(u);
+  free(v);
+}
+
+/* A bignum of 'len' zeroed limbs */
+lbig lbig_new(int neg, int len) {
+  lbig r = {neg, len, calloc(len ? len : 1, sizeof(uint32_t))};
+  return r;
+}
+
+lbig lbig_norm(lbig r) {
+  r.len = lmag_trim(r.mag, r.len);
+  if (r.len == 0) {
+    r.neg = 0;
+  }
+  return r;
+}
+
+/* View 'x' as a bignum stored in 'buf', without allocating */
+lbig lbig_view(long x, uint32_t buf[2]) {
+  uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  buf[0] = (uint32_t)m;
+  buf[1] = (uint32_t)(m >> 32);
+  lbig r = {x < 0, 2, buf};
+  return lbig_norm(r);
+}
+
+int lbig_cmp(lbig x, lbig y) {
+  if (x.neg != y.neg) {
+    return x.neg ? -1 : 1;
+  }
+  int c = lmag_cmp(x.mag, x.len, y.mag, y.len);
+  return x.neg ? -c : c;
+}
+
+/* x + y, or x - y when 'sub' is set */
+lbig lbig_add(lbig x, lbig y, int sub) {
+  int yneg = sub ? !y.neg : y.neg;
+  int n = (x.len > y.len ? x.len : y.len) + 1;
+
+  if (x.neg == yneg) {
+    lbig r = lbig_new(x.neg, n);
+    memcpy(r.mag, x.mag, sizeof(uint32_t) * x.len);
+    lmag_addto(r.mag, n, y.mag, y.len);
+    return lbig_norm(r);
+  }
+
+  /* Signs differ so subtract the smaller magnitude from the larger */
+  if (lmag_cmp(x.mag, x.len, y.mag, y.len) < 0) {
+    lbig t = x;
+    x = y;
+    y = t;
+    x.neg = yneg;
+  }
+  lbig r = lbig_new(x.neg, n);
+  memcpy(r.mag, x.mag, sizeof(uint32_t) * x.len);
+  lmag_subfrom(r.mag, n, y.mag, y.len);
+  return lbig_norm(r);
+}
+
+lbig lbig_mul(lbig x, lbig y) {
+  lbig r = lbig_new(x.neg != y.neg, x.len + y.len);
+  if (x.len && y.len) {
+    lmag_mul(r.mag, x.mag, x.len, y.mag, y.len);
+  }
+  return lbig_norm(r);
+}
+
+/* x / y rounded toward zero, for non-zero 'y' */
+lbig lbig_div(lbig x, lbig y) {
+  if (lmag_cmp(x.mag, x.len, y.mag, y.len) < 0) {
+    return lbig_new(0, 0);
+  }
+  lbig q = lbig_new(x.neg != y.neg, x.len - y.len + 1);
+  if (y.len == 1) {
+    lmag_divsmall(q.mag, x.mag, x.len, y.mag[0]);
+  } else {
+    lmag_div(q.mag, x.mag, x.len, y.mag, y.len);
+  }
+  return lbig_norm(q);
+}
+
+/* Parse the decimal digits of 's', with an optional leading '-' */
+lbig lbig_read(char *s) {
+  int neg = (*s == '-');
+  if (neg) {
+    s++;
+  }
+
+  /* Each limb holds over nine decimal digits */
+  int n = strlen(s) / 9 + 1;
+  lbig r = lbig_new(neg, n);
+  r.len = 0;
+  while (*s) {
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int k = 0; k < 9 && *s; k++, s++) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+    uint32_t c = lmag_muladd(r.mag, r.len, scale, chunk);
+    if (c) {
+      r.mag[r.len++] = c;
+    }
+  }
+  return lbig_norm(r);
+}
+
+/* The decimal digits of 'x' in a new string */
+char *lbig_str(lbig x) {
+  /* Peel off nine decimal digits at a time, least significant first */
+  uint32_t *t = malloc(sizeof(uint32_t) * (x.len ? x.len : 1));
+  uint32_t *chunks = malloc(sizeof(uint32_t) * (x.len * 10 / 9 + 2));
+  memcpy(t, x.mag, sizeof(uint32_t) * x.len);
+  int n = x.len;
+  int count = 0;
+  do {
+    chunks[count++] = lmag_divsmall(t, t, n, 1000000000u);
+    n = lmag_trim(t, n);
+  } while (n > 0);
+
+  char *s = malloc(count * 9 + 2);
+  char *p = s + sprintf(s, "%s%u", x.neg ? "-" : "", chunks[count - 1]);
+  for (int i = count - 2; i >= 0; i--) {
+    p += sprintf(p, "%09u", chunks[i]);
+  }
+  free(t);
+  free(chunks);
+  return s;
+}
+
+void lbig_print(lbig x) {
+  char *s = lbig_str(x);
+  fputs(s, stdout);
+  free(s);
+}
 
 /* Lisp Value */
 
@@ -40,40 +627,209 @@ enum {
   LVAL_FUN,
   LVAL_SEXPR,
   LVAL_QEXPR,
-  LVAL_BOOL
+  LVAL_BOOL,
+  LVAL_FLO,
+  LVAL_VEC,
+  LVAL_MAP,
+  LVAL_STR
 };
 
+/* A packed vector of either fixnum range integers or doubles */
+typedef struct lvec {
+  int len;
+  int flo;
+  long *ints;
+  double *flos;
+} lvec;
+
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
 struct lval {
   int type;
 
-  /* Basic */
-  long num;
-  int bool_val;
-  char *err;
-  char *sym;
-
-  /* Function */
-  lbuiltin builtin;
-  lenv *env;
-  lval *formals;
-  lval *body;
+  /* Values are shared by reference and must not be modified while
+   * 'refs' is above one, see lval_own */
+  int refs;
+
+  union {
+    /* Basic */
+    lbig big;
+    double flo;
+    lvec vec;
+    char *err;
+    char *sym;
+
+    /* Hash map of 'size' entries, NULL when empty */
+    struct {
+      lmap *map;
+      int size;
+    };
+
+    /* String, the 'len' bytes from 'off' on in 'str' */
+    struct {
+      lstr *str;
+      long off;
+      long len;
+    };
+
+    /* Function */
+    struct {
+      lbuiltin builtin;
+      int special;
+      lenv *env;
+      lval *formals;
+      lval *body;
+    };
+
+    /* Expression, the 'count' elements from 'cell' on in 'seq' */
+    struct {
+      lseq *seq;
+      int count;
+      lval **cell;
+
+      /* Compiled form of a Q-Expression, filled on first evaluation */
+      lcode *code;
+    };
+  };
+};
 
-  /* Expression */
-  int count;
-  lval **cell;
+/* Expression elements are held in an lseq, which any number of
+ * expressions may share as windows onto its 'items'. The lseq holds the
+ * reference to each of its items, so taking the head or tail of a list
+ * is a new window rather than a copy. An expression can append in place
+ * when its window ends where the used items do, as nothing else can see
+ * past that point. */
+struct lseq {
+  int refs;
+  int used;
+  int cap;
+  lval **items;
 };
 
+/* Immediates: an lval pointer with its low bit set is a number stored
+ * in the remaining bits, one with the second bit set is a boolean.
+ * Neither is allocated, so numbers and booleans cost nothing to create,
+ * share or delete. Numbers too large for the pointer go on the heap as
+ * bignums. */
+
+#define LTAG_FIX 1
+#define LTAG_BOOL 2
+#define LTAG_MASK 3
+
+#define LFIX_MAX (LONG_MAX >> 1)
+#define LFIX_MIN (-LFIX_MAX - 1)
+
+#define LVAL_IMM(v) ((uintptr_t)(v)&LTAG_MASK)
+#define LVAL_FIX(v) ((uintptr_t)(v)&LTAG_FIX)
+
+int ltype(lval *v) {
+  if ((uintptr_t)v & LTAG_FIX) {
+    return LVAL_NUM;
+  }
+  if ((uintptr_t)v & LTAG_BOOL) {
+    return LVAL_BOOL;
+  }
+  return v->type;
+}
+
+/* Value of fixnum 'v' */
+long lnum(lval *v) { return (long)((intptr_t)v >> 1); }
+
+int lbool(lval *v) { return (int)((uintptr_t)v >> 2); }
+
+lval *lval_alloc(void) {
+  lval *v = lheap_alloc(LOBJ_VAL, sizeof(lval));
+  v->refs = 1;
+  return v;
+}
+
+lval *lval_ref(lval *v) {
+  if (!LVAL_IMM(v)) {
+    v->refs++;
+  }
+  return v;
+}
+
+lval *lval_big(lbig x);
+
 lval *lval_num(long x) {
-  lval *v = malloc(sizeof(lval));
+  if (x >= LFIX_MIN && x <= LFIX_MAX) {
+    return (lval *)(((uintptr_t)x << 1) | LTAG_FIX);
+  }
+  uint32_t buf[2];
+  lbig b = lbig_view(x, buf);
+  lbig r = lbig_new(b.neg, b.len);
+  memcpy(r.mag, b.mag, sizeof(uint32_t) * b.len);
+  return lval_big(r);
+}
+
+/* Take bignum 'x', demoting it to a fixnum when it fits */
+lval *lval_big(lbig x) {
+  x = lbig_norm(x);
+  if (x.len <= 2) {
+    uint64_t m = x.len ? x.mag[0] : 0;
+    if (x.len == 2) {
+      m |= (uint64_t)x.mag[1] << 32;
+    }
+    /* LFIX_MIN has one more than LFIX_MAX as its magnitude */
+    if (m <= (uint64_t)LFIX_MAX + x.neg) {
+      free(x.mag);
+      return lval_num(x.neg ? -(long)m : (long)m);
+    }
+  }
+  lval *v = lval_alloc();
   v->type = LVAL_NUM;
-  v->num = x;
+  v->big = x;
+  return v;
+}
+
+lval *lval_flo(double x) {
+  lval *v = lval_alloc();
+  v->type = LVAL_FLO;
+  v->flo = x;
   return v;
 }
 
+/* Storage for 'len' uninitialised elements */
+lvec lvec_new(int len, int flo) {
+  lvec v = {len, flo, NULL, NULL};
+  if (flo) {
+    v.flos = malloc(sizeof(double) * (len > 0 ? len : 1));
+  } else {
+    v.ints = malloc(sizeof(long) * (len > 0 ? len : 1));
+  }
+  return v;
+}
+
+lval *lval_vec(int len, int flo) {
+  lval *v = lval_alloc();
+  v->type = LVAL_VEC;
+  v->vec = lvec_new(len, flo);
+  return v;
+}
+
+/* Any number as a double, promoting integers */
+double lval_to_flo(lval *v) {
+  if (LVAL_FIX(v)) {
+    return (double)lnum(v);
+  }
+  if (v->type == LVAL_FLO) {
+    return v->flo;
+  }
+  double d = 0;
+  for (int i = v->big.len - 1; i >= 0; i--) {
+    d = d * 4294967296.0 + v->big.mag[i];
+  }
+  return v->big.neg ? -d : d;
+}
+
+/* Any integer as a bignum, fixnums being viewed through 'buf' */
+lbig lval_to_big(lval *v, uint32_t buf[2]) {
+  return LVAL_FIX(v) ? lbig_view(lnum(v), buf) : v->big;
+}
+
 lval *lval_err(char *fmt, ...) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_ERR;
   va_list va;
   va_start(va, fmt);
@@ -85,41 +841,36 @@ lval *lval_err(char *fmt, ...) {
 }
 
 lval *lval_sym(char *s) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = lsym(s);
   return v;
 }
 
 lval *lval_builtin(lbuiltin func) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->special = 0;
   return v;
 }
 
 lenv *lenv_new(void);
+lenv *lenv_extend(lenv *par, lval *scope);
 
 lval *lval_bool(int bool_value) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
-  v->bool_val = bool_value;
-
-  /* printf("Creating a boolean type with value: %i\n", v->bool_val); */
-
-  return v;
+  return (lval *)(((uintptr_t)(bool_value != 0) << 2) | LTAG_BOOL);
 }
 
-lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
+lval *lval_lambda(lenv *e, lval *formals, lval *body) {
+  lval *v = lval_alloc();
   v->type = LVAL_FUN;
 
   /* Set Builtin to Null */
   v->builtin = NULL;
 
-  /* Build new environment */
-  v->env = lenv_new();
+  /* Build new environment, enclosed by the one the lambda was made in */
+  v->env = lenv_extend(e, formals);
 
   /* Set Formals and Body */
   v->formals = formals;
@@ -127,28 +878,90 @@ lval *lval_lambda(lval *formals, lval *body) {
   return v;
 }
 
+lseq *lseq_new(int cap) {
+  lseq *s = lheap_alloc(LOBJ_SEQ, sizeof(lseq));
+  s->refs = 1;
+  s->used = 0;
+  s->cap = cap;
+  s->items = malloc(sizeof(lval *) * (cap ? cap : 1));
+  return s;
+}
+
+void lval_del(lval *v);
+
+void lseq_del(lseq *s) {
+  if (--s->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < s->used; i++) {
+    lval_del(s->items[i]);
+  }
+  free(s->items);
+  lheap_free(s);
+}
+
 lval *lval_sexpr(void) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_SEXPR;
+  v->seq = NULL;
   v->count = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
 lval *lval_qexpr(void) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_QEXPR;
+  v->seq = NULL;
   v->count = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
+/* A Q-Expression of 'count' elements of 'v' from 'i', sharing them */
+lval *lval_slice(lval *v, int i, int count) {
+  lval *x = lval_qexpr();
+  if (count) {
+    x->seq = v->seq;
+    x->seq->refs++;
+    x->cell = v->cell + i;
+    x->count = count;
+  }
+  return x;
+}
+
 void lenv_del(lenv *e);
+void lcode_del(lcode *c);
+lcode *lcode_ref(lcode *c);
+void lmap_del(lmap *m);
+lmap *lmap_ref(lmap *m);
+void lstr_del(lstr *s);
+lstr *lstr_ref(lstr *s);
 
 void lval_del(lval *v) {
 
+  /* Only free once the last reference is released */
+  if (LVAL_IMM(v) || --v->refs > 0) {
+    return;
+  }
+
   switch (v->type) {
   case LVAL_NUM:
+    free(v->big.mag);
+    break;
+  case LVAL_VEC:
+    free(v->vec.ints);
+    free(v->vec.flos);
+    break;
+  case LVAL_MAP:
+    if (v->map) {
+      lmap_del(v->map);
+    }
+    break;
+  case LVAL_STR:
+    lstr_del(v->str);
     break;
   case LVAL_FUN:
     if (!v->builtin) {
@@ -161,85 +974,205 @@ void lval_del(lval *v) {
     free(v->err);
     break;
   case LVAL_SYM:
-    free(v->sym);
     break;
   case LVAL_QEXPR:
   case LVAL_SEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
+    if (v->seq) {
+      lseq_del(v->seq);
+    }
+    if (v->code) {
+      lcode_del(v->code);
     }
-    free(v->cell);
     break;
   }
 
-  free(v);
+  lheap_free(v);
 }
 
-lenv *lenv_copy(lenv *e);
+lenv *lenv_ref(lenv *e);
 
+/* Copy the outermost value, the copy shares everything it contains */
 lval *lval_copy(lval *v) {
-  lval *x = malloc(sizeof(lval));
+  if (LVAL_IMM(v)) {
+    return v;
+  }
+  lval *x = lval_alloc();
   x->type = v->type;
   switch (v->type) {
   case LVAL_FUN:
     if (v->builtin) {
       x->builtin = v->builtin;
+      x->special = v->special;
     } else {
       x->builtin = NULL;
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+      /* Calls bind into a fresh frame so the environment is never
+       * modified and can be shared */
+      x->env = lenv_ref(v->env);
+      x->formals = lval_ref(v->formals);
+      x->body = lval_ref(v->body);
     }
     break;
   case LVAL_NUM:
-    x->num = v->num;
+    x->big = lbig_new(v->big.neg, v->big.len);
+    memcpy(x->big.mag, v->big.mag, sizeof(uint32_t) * v->big.len);
+    break;
+  case LVAL_FLO:
+    x->flo = v->flo;
+    break;
+  case LVAL_VEC:
+    x->vec = lvec_new(v->vec.len, v->vec.flo);
+    if (v->vec.flo) {
+      memcpy(x->vec.flos, v->vec.flos, sizeof(double) * v->vec.len);
+    } else {
+      memcpy(x->vec.ints, v->vec.ints, sizeof(long) * v->vec.len);
+    }
+    break;
+  case LVAL_MAP:
+    /* Maps are persistent so the copy shares every node */
+    x->map = v->map ? lmap_ref(v->map) : NULL;
+    x->size = v->size;
+    break;
+  case LVAL_STR:
+    x->str = lstr_ref(v->str);
+    x->off = v->off;
+    x->len = v->len;
     break;
   case LVAL_ERR:
     x->err = malloc(strlen(v->err) + 1);
     strcpy(x->err, v->err);
     break;
   case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
+    x->sym = v->sym;
     break;
   case LVAL_SEXPR:
   case LVAL_QEXPR:
-    x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
+    /* Copies share elements, and the compiled code until either one is
+     * modified */
+    x->seq = v->seq;
+    if (x->seq) {
+      x->seq->refs++;
     }
+    x->count = v->count;
+    x->cell = v->cell;
+    x->code = v->code ? lcode_ref(v->code) : NULL;
     break;
   }
   return x;
 }
 
+/* Take 'v' and return a version of it which is safe to modify */
+lval *lval_own(lval *v) {
+  if (LVAL_IMM(v) || v->refs == 1) {
+    return v;
+  }
+  lval *x = lval_copy(v);
+  lval_del(v);
+  return x;
+}
+
+/* Any structural change makes previously compiled code stale */
+void lval_uncompile(lval *v) {
+  if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
+}
+
+/* Move the window of 'v' into storage of its own with room for 'n' */
+void lval_move(lval *v, int n) {
+  lseq *t = lseq_new(n > v->count ? n : v->count);
+  for (int i = 0; i < v->count; i++) {
+    t->items[i] = lval_ref(v->cell[i]);
+  }
+  t->used = v->count;
+  if (v->seq) {
+    lseq_del(v->seq);
+  }
+  v->seq = t;
+  v->cell = t->items;
+}
+
+/* Make room for 'n' elements in total so they can be added in place
+ * without reallocating. Storage that has to grow at least doubles, so
+ * repeated appends are amortised O(1). */
+void lval_reserve(lval *v, int n) {
+  lseq *s = v->seq;
+  int start = 0;
+  int end = 0;
+  if (s) {
+    start = v->cell - s->items;
+    end = start + v->count;
+
+    /* Items past the window are unreachable if nothing else shares them */
+    if (s->refs == 1) {
+      for (int i = end; i < s->used; i++) {
+        lval_del(s->items[i]);
+      }
+      s->used = end;
+    }
+    if (end == s->used && start + n <= s->cap) {
+      return;
+    }
+  }
+
+  if (n < v->count * 2) {
+    n = v->count * 2;
+  }
+  if (s && s->refs == 1 && end == s->used) {
+    s->cap = start + n;
+    s->items = realloc(s->items, sizeof(lval *) * s->cap);
+    v->cell = s->items + start;
+    return;
+  }
+  lval_move(v, n);
+}
+
 lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
+  lval_uncompile(v);
+  lseq *s = v->seq;
+  if (!s || v->cell + v->count != s->items + s->used || s->used == s->cap) {
+    lval_reserve(v, v->count < 4 ? 4 : v->count + 1);
+  }
+  v->cell[v->count++] = x;
+  v->seq->used++;
   return v;
 }
 
 lval *lval_join(lval *x, lval *y) {
+  lval_reserve(x, x->count + y->count);
   for (int i = 0; i < y->count; i++) {
-    x = lval_add(x, y->cell[i]);
+    x = lval_add(x, lval_ref(y->cell[i]));
   }
-  free(y->cell);
-  free(y);
+  lval_del(y);
   return x;
 }
 
+/* Remove element 'i' of 'v', returning a reference to it */
 lval *lval_pop(lval *v, int i) {
-  lval *x = v->cell[i];
+  lval_uncompile(v);
+  lval *x = lval_ref(v->cell[i]);
+
+  /* The first element is dropped by narrowing the window */
+  if (i == 0) {
+    v->cell++;
+    v->count--;
+    return x;
+  }
+
+  /* Elsewhere the window must be unshared, and end the used items */
+  if (v->seq->refs > 1) {
+    lval_move(v, v->count);
+  }
+  lval_reserve(v, v->count);
+  lval_del(v->cell[i]);
   memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+  v->seq->used--;
   return x;
 }
 
 lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
+  lval *x = lval_ref(v->cell[i]);
   lval_del(v);
   return x;
 }
@@ -257,8 +1190,66 @@ void lval_print_expr(lval *v, char open, char close) {
   putchar(close);
 }
 
-void lval_print(lval *v) {
-  switch (v->type) {
+/* Print the shortest form that reads back as 'x', always with a point
+ * or exponent so it reads back as a float. Infinities and NaN take the
+ * spellings the reader accepts for them. */
+void lval_print_flo(double x) {
+  if (isnan(x)) {
+    printf("+nan.0");
+    return;
+  }
+  if (isinf(x)) {
+    printf(x > 0 ? "+inf.0" : "-inf.0");
+    return;
+  }
+  char buf[32];
+  for (int prec = 15; prec <= 17; prec++) {
+    snprintf(buf, sizeof(buf), "%.*g", prec, x);
+    if (strtod(buf, NULL) == x) {
+      break;
+    }
+  }
+  printf("%s", buf);
+  if (!strpbrk(buf, ".e")) {
+    printf(".0");
+  }
+}
+
+typedef void (*lmap_fn)(void *ctx, lval *k, lval *v);
+void lmap_each(lmap *m, lmap_fn fn, void *ctx);
+char *lval_str_data(lval *v);
+
+/* Escape sequences, the letter after the backslash and the byte it is */
+char lesc_names[] = "abfnrtv\\\"0";
+char lesc_bytes[] = {'\a', '\b', '\f', '\n', '\r', '\t', '\v', '\\', '"', '\0'};
+
+void lval_print_str(lval *v) {
+  char *p = lval_str_data(v);
+  putchar('"');
+  for (long i = 0; i < v->len; i++) {
+    char *esc = memchr(lesc_bytes, p[i], sizeof(lesc_bytes));
+    if (esc) {
+      putchar('\\');
+      putchar(lesc_names[esc - lesc_bytes]);
+    } else {
+      putchar(p[i]);
+    }
+  }
+  putchar('"');
+}
+
+void lval_print_entry(void *first, lval *k, lval *v) {
+  if (!*(int *)first) {
+    putchar(' ');
+  }
+  *(int *)first = 0;
+  lval_print(k);
+  putchar(' ');
+  lval_print(v);
+}
+
+void lval_print(lval *v) {
+  switch (ltype(v)) {
   case LVAL_FUN:
     if (v->builtin) {
       printf("<builtin>");
@@ -271,10 +1262,41 @@ void lval_print(lval *v) {
     }
     break;
   case LVAL_NUM:
-    printf("%li", v->num);
+    if (LVAL_FIX(v)) {
+      printf("%li", lnum(v));
+    } else {
+      lbig_print(v->big);
+    }
+    break;
+  case LVAL_FLO:
+    lval_print_flo(v->flo);
+    break;
+  case LVAL_VEC:
+    putchar('[');
+    for (int i = 0; i < v->vec.len; i++) {
+      if (i) {
+        putchar(' ');
+      }
+      if (v->vec.flo) {
+        lval_print_flo(v->vec.flos[i]);
+      } else {
+        printf("%li", v->vec.ints[i]);
+      }
+    }
+    putchar(']');
+    break;
+  case LVAL_MAP: {
+    int first = 1;
+    printf("#{");
+    lmap_each(v->map, lval_print_entry, &first);
+    putchar('}');
+    break;
+  }
+  case LVAL_STR:
+    lval_print_str(v);
     break;
   case LVAL_BOOL:
-    printf("%s", v->bool_val == 1 ? "true" : "false");
+    printf("%s", lbool(v) ? "true" : "false");
     break;
   case LVAL_ERR:
     printf("Error: %s", v->err);
@@ -302,6 +1324,14 @@ char *ltype_name(int t) {
     return "Function";
   case LVAL_NUM:
     return "Number";
+  case LVAL_FLO:
+    return "Float";
+  case LVAL_VEC:
+    return "Vector";
+  case LVAL_MAP:
+    return "Map";
+  case LVAL_STR:
+    return "String";
   case LVAL_BOOL:
     return "Boolean";
   case LVAL_ERR:
@@ -317,345 +1347,2441 @@ char *ltype_name(int t) {
   }
 }
 
-/* Lisp Environment */
-
-struct lenv {
-  lenv *par;
+/* Hash Maps */
+
+/* Maps are persistent hash array mapped tries. Each node covers five
+ * bits of the key's hash, with 'bitmap' marking which of its 32 slots
+ * are in use and 'entries' holding just those, in order. An entry is
+ * either a key and value or a child node. Updates copy the path down
+ * from the root and share the rest, so earlier versions stay valid and
+ * copying a map is O(1). Keys whose hashes agree in every bit share a
+ * collision node at the bottom, searched linearly. */
+
+#define LMAP_BITS 5
+#define LMAP_COLLIDE 32
+
+typedef struct lentry {
+  uint32_t hash;
+  lval *key;
+  lval *val;
+  lmap *child;
+} lentry;
+
+struct lmap {
+  int refs;
+  uint32_t bitmap;
   int count;
-  char **syms;
-  lval **vals;
+  lentry *entries;
 };
 
-lenv *lenv_new(void) {
-  lenv *e = malloc(sizeof(lenv));
-  e->par = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
+int lbits(uint32_t x) {
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  x = (x + (x >> 4)) & 0x0F0F0F0Fu;
+  return (int)((x * 0x01010101u) >> 24);
 }
 
-void lenv_del(lenv *e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+uint32_t lhash_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
 }
 
-lenv *lenv_copy(lenv *e) {
-  lenv *n = malloc(sizeof(lenv));
-  n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char *) * n->count);
-  n->vals = malloc(sizeof(lval *) * n->count);
-  for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+/* Hash of 'v' agreeing with lval_equal. Clears '*ok' if 'v' cannot be
+ * used as a key. */
+uint32_t lval_hash(lval *v, int *ok) {
+  switch (ltype(v)) {
+  case LVAL_NUM: {
+    if (LVAL_FIX(v)) {
+      return lhash_mix((uint64_t)lnum(v));
+    }
+    uint64_t h = v->big.neg;
+    for (int i = 0; i < v->big.len; i++) {
+      h = h * 1000003 + v->big.mag[i];
+    }
+    return lhash_mix(h);
+  }
+  case LVAL_FLO: {
+    /* Zero and negative zero are equal so must hash the same */
+    double d = v->flo == 0 ? 0 : v->flo;
+    uint64_t b;
+    memcpy(&b, &d, sizeof(b));
+    return lhash_mix(b ^ 0x9e3779b97f4a7c15ULL);
+  }
+  case LVAL_BOOL:
+    return lhash_mix((uintptr_t)v);
+  case LVAL_SYM:
+    return lhash_mix((uintptr_t)v->sym);
+  case LVAL_STR: {
+    char *p = lval_str_data(v);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (long i = 0; i < v->len; i++) {
+      h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    }
+    return lhash_mix(h);
+  }
+  case LVAL_QEXPR: {
+    uint64_t h = v->count;
+    for (int i = 0; i < v->count; i++) {
+      h = h * 1000003 + lval_hash(v->cell[i], ok);
+    }
+    return lhash_mix(h);
+  }
+  default:
+    *ok = 0;
+    return 0;
   }
-  return n;
 }
 
-lval *lenv_get(lenv *e, lval *k) {
-
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+/* Whether keys 'x' and 'y' are the same */
+int lval_equal(lval *x, lval *y) {
+  if (x == y) {
+    return 1;
+  }
+  int t = ltype(x);
+  if (t != ltype(y)) {
+    return 0;
+  }
+  switch (t) {
+  case LVAL_NUM:
+    /* Fixnums are equal only if identical, and never equal a bignum */
+    if (LVAL_FIX(x) || LVAL_FIX(y)) {
+      return 0;
+    }
+    return x->big.neg == y->big.neg && x->big.len == y->big.len &&
+           memcmp(x->big.mag, y->big.mag, sizeof(uint32_t) * x->big.len) == 0;
+  case LVAL_FLO:
+    return x->flo == y->flo;
+  case LVAL_SYM:
+    return x->sym == y->sym;
+  case LVAL_STR:
+    return x->len == y->len &&
+           memcmp(lval_str_data(x), lval_str_data(y), x->len) == 0;
+  case LVAL_QEXPR:
+    if (x->count != y->count) {
+      return 0;
+    }
+    for (int i = 0; i < x->count; i++) {
+      if (!lval_equal(x->cell[i], y->cell[i])) {
+        return 0;
+      }
     }
+    return 1;
+  default:
+    return 0;
   }
+}
 
-  /* If no symbol check in parent otherwise error */
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
-  }
+lmap *lmap_new(uint32_t bitmap, int count) {
+  lmap *m = lheap_alloc(LOBJ_MAP, sizeof(lmap));
+  m->refs = 1;
+  m->bitmap = bitmap;
+  m->count = count;
+  m->entries = malloc(sizeof(lentry) * (count ? count : 1));
+  return m;
 }
 
-void lenv_put(lenv *e, lval *k, lval *v) {
+lmap *lmap_ref(lmap *m) {
+  m->refs++;
+  return m;
+}
 
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
+void lmap_del(lmap *m) {
+  if (--m->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < m->count; i++) {
+    lentry *e = &m->entries[i];
+    if (e->child) {
+      lmap_del(e->child);
+    } else {
+      lval_del(e->key);
+      lval_del(e->val);
     }
   }
-
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  free(m->entries);
+  lheap_free(m);
 }
 
-void lenv_def(lenv *e, lval *k, lval *v) {
-  /* Iterate till e has no parent */
-  while (e->par) {
-    e = e->par;
+/* Copy 'e' into 'to', taking new references */
+void lentry_copy(lentry *to, lentry *e) {
+  *to = *e;
+  if (e->child) {
+    lmap_ref(e->child);
+  } else {
+    lval_ref(e->key);
+    lval_ref(e->val);
   }
-  /* Put value in e */
-  lenv_put(e, k, v);
 }
 
-/* Builtins */
-
-#define LASSERT(args, cond, fmt, ...)                                          \
-  if (!(cond)) {                                                               \
-    lval *err = lval_err(fmt, ##__VA_ARGS__);                                  \
-    lval_del(args);                                                            \
-    return err;                                                                \
+/* A copy of node 'm', sharing what its entries refer to. With 'skip'
+ * zero or more the entry at 'skip' is left out. */
+lmap *lmap_copy(lmap *m, uint32_t bitmap, int skip) {
+  lmap *r = lmap_new(bitmap, skip >= 0 ? m->count - 1 : m->count);
+  for (int i = 0, j = 0; i < m->count; i++) {
+    if (i != skip) {
+      lentry_copy(&r->entries[j++], &m->entries[i]);
+    }
   }
+  return r;
+}
 
-#define LASSERT_TYPE(func, args, index, expect)                                \
-  LASSERT(args, args->cell[index]->type == expect,                             \
-          "Function '%s' passed incorrect type for argument %i. "              \
-          "Got %s, Expected %s.",                                              \
-          func, index, ltype_name(args->cell[index]->type),                    \
-          ltype_name(expect))
-
-#define LASSERT_NUM(func, args, num)                                           \
-  LASSERT(args, args->count == num,                                            \
-          "Function '%s' passed incorrect number of arguments. "               \
-          "Got %i, Expected %i.",                                              \
-          func, args->count, num)
-
-#define LASSERT_NOT_EMPTY(func, args, index)                                   \
-  LASSERT(args, args->cell[index]->count != 0,                                 \
-          "Function '%s' passed {} for argument %i.", func, index);
-
-lval *lval_eval(lenv *e, lval *v);
-
-lval *builtin_lambda(lenv *e, lval *a) {
-  /* Check Two arguments, each of which are Q-Expressions */
-  LASSERT_NUM("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
-
-  /* Check first Q-Expression contains only Symbols */
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+lval *lmap_get(lmap *m, uint32_t h, lval *k) {
+  int shift = 0;
+  while (m) {
+    if (shift >= LMAP_COLLIDE) {
+      for (int i = 0; i < m->count; i++) {
+        if (lval_equal(m->entries[i].key, k)) {
+          return m->entries[i].val;
+        }
+      }
+      return NULL;
+    }
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    if (!(m->bitmap & bit)) {
+      return NULL;
+    }
+    lentry *e = &m->entries[lbits(m->bitmap & (bit - 1))];
+    if (!e->child) {
+      return e->hash == h && lval_equal(e->key, k) ? e->val : NULL;
+    }
+    m = e->child;
+    shift += LMAP_BITS;
   }
-
-  /* Pop first two arguments and pass them to lval_lambda */
-  lval *formals = lval_pop(a, 0);
-  lval *body = lval_pop(a, 0);
-  lval_del(a);
-
-  return lval_lambda(formals, body);
+  return NULL;
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-  a->type = LVAL_QEXPR;
-  return a;
-}
+/* 'm' with 'k' bound to 'v', setting '*added' if 'k' is new. 'm' may be
+ * NULL for an empty node. */
+lmap *lmap_assoc(lmap *m, uint32_t h, lval *k, lval *v, int shift,
+                 int *added) {
+  lentry x = {h, k, v, NULL};
+
+  if (shift >= LMAP_COLLIDE) {
+    int n = m ? m->count : 0;
+    for (int i = 0; i < n; i++) {
+      if (lval_equal(m->entries[i].key, k)) {
+        lmap *r = lmap_copy(m, 0, -1);
+        lval_del(r->entries[i].val);
+        r->entries[i].val = lval_ref(v);
+        return r;
+      }
+    }
+    lmap *r = lmap_new(0, n + 1);
+    for (int i = 0; i < n; i++) {
+      lentry_copy(&r->entries[i], &m->entries[i]);
+    }
+    lentry_copy(&r->entries[n], &x);
+    *added = 1;
+    return r;
+  }
 
-lval *builtin_gt(lenv *e, lval *a) {
-  char *func = ">";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
+  uint32_t bit = 1u << ((h >> shift) & 31);
+  uint32_t bitmap = m ? m->bitmap : 0;
+  int i = lbits(bitmap & (bit - 1));
 
-  if (a->cell[0]->num > a->cell[1]->num) {
-    return lval_bool(1);
-  } else {
-    return lval_bool(0);
+  /* Open a new slot */
+  if (!(bitmap & bit)) {
+    int n = m ? m->count : 0;
+    lmap *r = lmap_new(bitmap | bit, n + 1);
+    for (int j = 0; j < n; j++) {
+      lentry_copy(&r->entries[j < i ? j : j + 1], &m->entries[j]);
+    }
+    lentry_copy(&r->entries[i], &x);
+    *added = 1;
+    return r;
   }
-}
-
-lval *builtin_lt(lenv *e, lval *a) {
-  char *func = "<";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
 
-  if (a->cell[0]->num < a->cell[1]->num) {
-    return lval_bool(1);
+  lmap *r = lmap_copy(m, bitmap, -1);
+  lentry *e = &r->entries[i];
+  if (e->child) {
+    lmap *c = lmap_assoc(e->child, h, k, v, shift + LMAP_BITS, added);
+    lmap_del(e->child);
+    e->child = c;
+  } else if (e->hash == h && lval_equal(e->key, k)) {
+    lval_del(e->val);
+    e->val = lval_ref(v);
   } else {
-    return lval_bool(0);
+    /* Two keys want this slot so move both down a level */
+    lmap *c = lmap_assoc(NULL, e->hash, e->key, e->val, shift + LMAP_BITS,
+                         added);
+    lmap *d = lmap_assoc(c, h, k, v, shift + LMAP_BITS, added);
+    lmap_del(c);
+    lval_del(e->key);
+    lval_del(e->val);
+    e->key = NULL;
+    e->val = NULL;
+    e->child = d;
   }
+  return r;
 }
 
-lval *builtin_eq(lenv *e, lval *a) {
-  char *func = "==";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
+/* 'm' without 'k', or NULL once empty, setting '*removed' if 'k' was
+ * there. An absent key gives back 'm' with a new reference. */
+lmap *lmap_dissoc(lmap *m, uint32_t h, lval *k, int shift, int *removed) {
+  if (shift >= LMAP_COLLIDE) {
+    for (int i = 0; i < m->count; i++) {
+      if (lval_equal(m->entries[i].key, k)) {
+        *removed = 1;
+        return m->count == 1 ? NULL : lmap_copy(m, 0, i);
+      }
+    }
+    return lmap_ref(m);
+  }
 
-  if (a->cell[0]->num == a->cell[1]->num) {
-    return lval_bool(1);
-  } else {
-    return lval_bool(0);
+  uint32_t bit = 1u << ((h >> shift) & 31);
+  if (!(m->bitmap & bit)) {
+    return lmap_ref(m);
+  }
+  int i = lbits(m->bitmap & (bit - 1));
+  lentry *e = &m->entries[i];
+
+  if (e->child) {
+    lmap *c = lmap_dissoc(e->child, h, k, shift + LMAP_BITS, removed);
+    if (c == e->child) {
+      lmap_del(c);
+      return lmap_ref(m);
+    }
+    if (c) {
+      lmap *r = lmap_copy(m, m->bitmap, -1);
+      lmap_del(r->entries[i].child);
+      r->entries[i].child = c;
+      return r;
+    }
+  } else if (e->hash != h || !lval_equal(e->key, k)) {
+    return lmap_ref(m);
   }
-}
 
-lval *builtin_uneq(lenv *e, lval *a) {
-  char *func = "!=";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
+  /* The slot is now empty */
+  *removed = 1;
+  return m->count == 1 ? NULL : lmap_copy(m, m->bitmap & ~bit, i);
+}
 
-  if (a->cell[0]->num != a->cell[1]->num) {
-    return lval_bool(1);
-  } else {
-    return lval_bool(0);
+void lmap_each(lmap *m, lmap_fn fn, void *ctx) {
+  for (int i = 0; m && i < m->count; i++) {
+    lentry *e = &m->entries[i];
+    if (e->child) {
+      lmap_each(e->child, fn, ctx);
+    } else {
+      fn(ctx, e->key, e->val);
+    }
   }
 }
 
-lval *builtin_ge(lenv *e, lval *a) {
-  char *func = ">=";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
-
-  return (builtin_gt(e, a)->bool_val || builtin_eq(e, a)->bool_val)
-             ? lval_bool(1)
-             : lval_bool(0);
+lval *lval_map(lmap *m, int size) {
+  lval *v = lval_alloc();
+  v->type = LVAL_MAP;
+  v->map = m;
+  v->size = size;
+  return v;
 }
 
-lval *builtin_le(lenv *e, lval *a) {
-  char *func = "<=";
-  LASSERT_NUM(func, a, 2);
-  LASSERT_TYPE(func, a, 0, LVAL_NUM);
-  LASSERT_TYPE(func, a, 1, LVAL_NUM);
+/* Strings */
+
+/* String bytes are immutable and shared. A leaf holds 'used' bytes of
+ * 'data' and any number of strings may be windows onto it, so slicing
+ * copies nothing. Like an lseq, a window ending where the used bytes do
+ * can be appended to in place. Otherwise long strings are concatenated
+ * as a rope node over 'left' and 'right', which is flattened into a
+ * leaf in place the first time its bytes are needed. */
+
+struct lstr {
+  int refs;
+  int depth;
+  long used;
+  long cap;
+  char *data;
+  lval *left;
+  lval *right;
+};
 
-  return (builtin_lt(e, a)->bool_val || builtin_eq(e, a)->bool_val)
-             ? lval_bool(1)
-             : lval_bool(0);
+/* Strings up to this long are always joined by copying */
+#define LSTR_SHORT 256
+
+/* Ropes deeper than this are flattened as they are built */
+#define LSTR_DEPTH 32
+
+lstr *lstr_new(long cap) {
+  lstr *s = lheap_alloc(LOBJ_STR, sizeof(lstr));
+  s->refs = 1;
+  s->depth = 0;
+  s->used = 0;
+  s->cap = cap;
+  s->data = malloc(cap ? cap : 1);
+  s->left = NULL;
+  s->right = NULL;
+  return s;
 }
 
-lval *builtin_head(lenv *e, lval *a) {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
+lstr *lstr_ref(lstr *s) {
+  s->refs++;
+  return s;
+}
 
-  lval *v = lval_take(a, 0);
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
+void lstr_del(lstr *s) {
+  if (--s->refs > 0) {
+    return;
   }
-  return v;
+  free(s->data);
+  if (s->depth) {
+    lval_del(s->left);
+    lval_del(s->right);
+  }
+  lheap_free(s);
 }
 
-lval *builtin_tail(lenv *e, lval *a) {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
-
-  lval *v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
+lval *lval_str_window(lstr *s, long off, long len) {
+  lval *v = lval_alloc();
+  v->type = LVAL_STR;
+  v->str = s;
+  v->off = off;
+  v->len = len;
   return v;
 }
 
-lval *builtin_eval(lenv *e, lval *a) {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
-  lval *x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+lval *lval_str(char *data, long len) {
+  lstr *s = lstr_new(len);
+  memcpy(s->data, data, len);
+  s->used = len;
+  return lval_str_window(s, 0, len);
 }
 
-lval *builtin_if(lenv *e, lval *a) {
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_BOOL);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-
-  int cond = a->cell[0]->bool_val;
-
-  lval *x;
-
-  if (cond) {
-    x = lval_take(a, 1);
-  } else {
-    x = lval_take(a, 2);
+/* Copy the bytes of string 'v' to 'out' */
+void lstr_write(lval *v, char *out) {
+  lstr *s = v->str;
+  if (!s->depth) {
+    memcpy(out, s->data + v->off, v->len);
+    return;
   }
+  long n = s->left->len;
+  lstr_write(s->left, out);
+  lstr_write(s->right, out + n);
+}
 
-  lval_del(a);
-
-  x->type = LVAL_SEXPR;
+/* Turn rope 's' into a leaf holding the same bytes */
+void lstr_flatten(lstr *s) {
+  if (!s->depth) {
+    return;
+  }
+  s->data = malloc(s->used ? s->used : 1);
+  s->cap = s->used;
+  lstr_write(s->left, s->data);
+  lstr_write(s->right, s->data + s->left->len);
+  lval_del(s->left);
+  lval_del(s->right);
+  s->left = NULL;
+  s->right = NULL;
+  s->depth = 0;
+}
 
-  return lval_eval(e, x);
+/* The bytes of string 'v', which are not NUL terminated */
+char *lval_str_data(lval *v) {
+  lstr_flatten(v->str);
+  return v->str->data + v->off;
 }
 
-lval *builtin_join(lenv *e, lval *a) {
+/* The 'n' bytes of 'v' from 'i', sharing its storage */
+lval *lval_str_slice(lval *v, long i, long n) {
+  lstr_flatten(v->str);
+  return lval_str_window(lstr_ref(v->str), v->off + i, n);
+}
 
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+/* Take strings 'x' and 'y' and return them joined */
+lval *lval_str_join(lval *x, lval *y) {
+  if (y->len == 0) {
+    lval_del(y);
+    return x;
+  }
+  if (x->len == 0) {
+    lval_del(x);
+    return y;
+  }
+  lstr *s = x->str;
+  long n = x->len + y->len;
+
+  /* Append in place when nothing can see past the end of 'x' */
+  if (!s->depth && x->off + x->len == s->used) {
+    if (s->used + y->len > s->cap) {
+      long cap = s->cap * 2;
+      s->cap = cap > s->used + y->len ? cap : s->used + y->len;
+      s->data = realloc(s->data, s->cap);
+    }
+    lstr_write(y, s->data + s->used);
+    s->used += y->len;
+    lval *r = lval_str_window(lstr_ref(s), x->off, n);
+    lval_del(x);
+    lval_del(y);
+    return r;
   }
 
-  lval *x = lval_pop(a, 0);
-
-  while (a->count) {
-    lval *y = lval_pop(a, 0);
-    x = lval_join(x, y);
+  if (n <= LSTR_SHORT) {
+    lstr *t = lstr_new(n);
+    lstr_write(x, t->data);
+    lstr_write(y, t->data + x->len);
+    t->used = n;
+    lval_del(x);
+    lval_del(y);
+    return lval_str_window(t, 0, n);
   }
 
-  lval_del(a);
-  return x;
+  lstr *t = lheap_alloc(LOBJ_STR, sizeof(lstr));
+  int dx = x->str->depth;
+  int dy = y->str->depth;
+  t->refs = 1;
+  t->depth = (dx > dy ? dx : dy) + 1;
+  t->used = n;
+  t->cap = 0;
+  t->data = NULL;
+  t->left = x;
+  t->right = y;
+  if (t->depth > LSTR_DEPTH) {
+    lstr_flatten(t);
+  }
+  return lval_str_window(t, 0, n);
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
+/* Lisp Environment */
 
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
-  }
+/* Symbols are kept in an open addressing hash table. 'syms' and 'vals'
+ * have 'cap' slots (a power of two), with NULL marking an empty slot.
+ * Environments are shared by the functions closing over them, and each
+ * holds a reference to its parent.
+ *
+ * A function's environment also has a 'scope', the list of its formals,
+ * and a flat 'locals' array holding the value bound to each of them by
+ * position. Compiled code addresses these directly. */
+struct lenv {
+  int refs;
+  lenv *par;
+  int count;
+  int cap;
+  char **syms;
+  lval **vals;
 
-  lval *x = lval_pop(a, 0);
+  lval *scope;
+  lval **locals;
+};
 
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
-  }
+lenv *lenv_new(void) {
+  lenv *e = lheap_alloc(LOBJ_ENV, sizeof(lenv));
+  e->refs = 1;
+  e->par = NULL;
+  e->count = 0;
+  e->cap = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->scope = NULL;
+  e->locals = NULL;
+  return e;
+}
+
+lenv *lenv_ref(lenv *e) {
+  e->refs++;
+  return e;
+}
 
-  while (a->count > 0) {
-    lval *y = lval_pop(a, 0);
+/* A new empty environment enclosed by 'par', with locals for 'scope' */
+lenv *lenv_extend(lenv *par, lval *scope) {
+  lenv *e = lenv_new();
+  e->par = lenv_ref(par);
+  e->scope = lval_ref(scope);
+  e->locals = calloc(scope->count, sizeof(lval *));
+  return e;
+}
 
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    }
-    if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
-    }
-    if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
+void lenv_del(lenv *e) {
+  if (--e->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < e->cap; i++) {
+    if (e->syms[i]) {
+      lval_del(e->vals[i]);
     }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero.");
-        break;
+  }
+  if (e->scope) {
+    for (int i = 0; i < e->scope->count; i++) {
+      if (e->locals[i]) {
+        lval_del(e->locals[i]);
       }
-      x->num /= y->num;
     }
-
-    lval_del(y);
+    lval_del(e->scope);
   }
-
-  lval_del(a);
+  if (e->par) {
+    lenv_del(e->par);
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e->locals);
+  lheap_free(e);
+}
+
+lenv *lenv_copy(lenv *e) {
+  lenv *n = lheap_alloc(LOBJ_ENV, sizeof(lenv));
+  n->refs = 1;
+  n->par = e->par ? lenv_ref(e->par) : NULL;
+  n->count = e->count;
+  n->cap = e->count ? e->cap : 0;
+  n->syms = NULL;
+  n->vals = NULL;
+  if (n->cap) {
+    n->syms = calloc(n->cap, sizeof(char *));
+    n->vals = calloc(n->cap, sizeof(lval *));
+  }
+  for (int i = 0; i < n->cap; i++) {
+    if (e->syms[i]) {
+      n->syms[i] = e->syms[i];
+      n->vals[i] = lval_ref(e->vals[i]);
+    }
+  }
+  n->scope = NULL;
+  n->locals = NULL;
+  if (e->scope) {
+    n->scope = lval_ref(e->scope);
+    n->locals = malloc(sizeof(lval *) * e->scope->count);
+    for (int i = 0; i < e->scope->count; i++) {
+      n->locals[i] = e->locals[i] ? lval_ref(e->locals[i]) : NULL;
+    }
+  }
+  return n;
+}
+
+/* Position of 'sym' among the locals of 'e', or -1 */
+int lenv_local(lenv *e, char *sym) {
+  if (e->scope) {
+    for (int i = 0; i < e->scope->count; i++) {
+      if (e->scope->cell[i]->sym == sym) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+void lenv_set_local(lenv *e, int i, lval *v) {
+  if (e->locals[i]) {
+    lval_del(e->locals[i]);
+  }
+  e->locals[i] = lval_ref(v);
+}
+
+/* Symbols are interned so their address identifies them */
+unsigned long lenv_hash(char *sym) {
+  return ((uintptr_t)sym >> 4) * 2654435761u;
+}
+
+/* Index of the slot holding 'sym', or of the empty slot it would go in */
+int lenv_slot(lenv *e, char *sym, unsigned long h) {
+  int mask = e->cap - 1;
+  int i = h & mask;
+  while (e->syms[i] && e->syms[i] != sym) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void lenv_grow(lenv *e) {
+  int cap = e->cap;
+  char **syms = e->syms;
+  lval **vals = e->vals;
+
+  e->cap = cap ? cap * 2 : 8;
+  e->syms = calloc(e->cap, sizeof(char *));
+  e->vals = calloc(e->cap, sizeof(lval *));
+
+  /* Reinsert every entry at its position in the larger table */
+  for (int i = 0; i < cap; i++) {
+    if (syms[i]) {
+      int j = lenv_slot(e, syms[i], lenv_hash(syms[i]));
+      e->syms[j] = syms[i];
+      e->vals[j] = vals[i];
+    }
+  }
+  free(syms);
+  free(vals);
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+  unsigned long h = lenv_hash(k->sym);
+
+  /* Search each environment up the parent chain */
+  for (; e; e = e->par) {
+    int l = lenv_local(e, k->sym);
+    if (l >= 0 && e->locals[l]) {
+      return lval_ref(e->locals[l]);
+    }
+    if (e->count == 0) {
+      continue;
+    }
+    int i = lenv_slot(e, k->sym, h);
+    if (e->syms[i]) {
+      return lval_ref(e->vals[i]);
+    }
+  }
+  return lval_err("Unbound Symbol '%s'", k->sym);
+}
+
+void lenv_put(lenv *e, lval *k, lval *v) {
+  unsigned long h = lenv_hash(k->sym);
+
+  /* Formals are bound in place */
+  int l = lenv_local(e, k->sym);
+  if (l >= 0) {
+    lenv_set_local(e, l, v);
+    return;
+  }
+
+  /* Replace an existing binding */
+  if (e->count) {
+    int i = lenv_slot(e, k->sym, h);
+    if (e->syms[i]) {
+      lval_del(e->vals[i]);
+      e->vals[i] = lval_ref(v);
+      return;
+    }
+  }
+
+  /* Keep the table at most half full */
+  if ((e->count + 1) * 2 > e->cap) {
+    lenv_grow(e);
+  }
+
+  int i = lenv_slot(e, k->sym, h);
+  e->count++;
+  e->vals[i] = lval_ref(v);
+  e->syms[i] = k->sym;
+}
+
+/* The global environment 'e' is nested in */
+lenv *lenv_root(lenv *e) {
+  /* Iterate till e has no parent */
+  while (e->par) {
+    e = e->par;
+  }
+  return e;
+}
+
+void lenv_def(lenv *e, lval *k, lval *v) { lenv_put(lenv_root(e), k, v); }
+
+/* Bytecode */
+
+/* OP_LOCAL reads a formal directly from the environment 'depth' levels
+ * up, by its position in that environment's scope. */
+enum { OP_CONST, OP_LOAD, OP_LOCAL, OP_SEXPR, OP_RET };
+
+struct lcode {
+  int refs;
+
+  /* Instruction stream of opcodes and their operands */
+  int count;
+  int *ops;
+
+  /* Maximum VM stack depth needed to run */
+  int depth;
+
+  /* Constants and symbols referenced by index from the stream */
+  int nconsts;
+  lval **consts;
+
+  /* Scopes of the environments the locals were resolved against,
+   * innermost first. Code only runs in environments with these scopes,
+   * so the same expression run elsewhere is compiled again into 'alt'. */
+  int nscopes;
+  lval **scopes;
+  lcode *alt;
+};
+
+/* An empty lcode is a placeholder, compiled when first run */
+lcode *lcode_new(void) {
+  lcode *c = lheap_alloc(LOBJ_CODE, sizeof(lcode));
+  c->refs = 1;
+  c->count = 0;
+  c->ops = NULL;
+  c->depth = 0;
+  c->nconsts = 0;
+  c->consts = NULL;
+  c->nscopes = 0;
+  c->scopes = NULL;
+  c->alt = NULL;
+  return c;
+}
+
+lcode *lcode_ref(lcode *c) {
+  c->refs++;
+  return c;
+}
+
+void lcode_del(lcode *c) {
+  if (--c->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < c->nconsts; i++) {
+    lval_del(c->consts[i]);
+  }
+  for (int i = 0; i < c->nscopes; i++) {
+    if (c->scopes[i]) {
+      lval_del(c->scopes[i]);
+    }
+  }
+  if (c->alt) {
+    lcode_del(c->alt);
+  }
+  free(c->consts);
+  free(c->scopes);
+  free(c->ops);
+  lheap_free(c);
+}
+
+void lcode_emit(lcode *c, int op) {
+  c->count++;
+  c->ops = realloc(c->ops, sizeof(int) * c->count);
+  c->ops[c->count - 1] = op;
+}
+
+int lcode_const(lcode *c, lval *v) {
+  c->nconsts++;
+  c->consts = realloc(c->consts, sizeof(lval *) * c->nconsts);
+  c->consts[c->nconsts - 1] = v;
+  return c->nconsts - 1;
+}
+
+void lcode_push(lcode *c, int *sp) {
+  (*sp)++;
+  if (*sp > c->depth) {
+    c->depth = *sp;
+  }
+}
+
+/* Depth of the environment above 'e' with 'sym' as a local, storing its
+ * position in '*slot', or -1. Scopes passed through are recorded. */
+int lcode_resolve(lcode *c, lenv *e, char *sym, int *slot) {
+  int depth = 0;
+  for (lenv *x = e; x; x = x->par, depth++) {
+    *slot = lenv_local(x, sym);
+    if (*slot >= 0) {
+      break;
+    }
+  }
+  if (*slot < 0) {
+    return -1;
+  }
+
+  if (depth >= c->nscopes) {
+    c->scopes = realloc(c->scopes, sizeof(lval *) * (depth + 1));
+    lenv *x = e;
+    for (int i = 0; i <= depth; i++, x = x->par) {
+      if (i >= c->nscopes) {
+        c->scopes[i] = x->scope ? lval_ref(x->scope) : NULL;
+      }
+    }
+    c->nscopes = depth + 1;
+  }
+  return depth;
+}
+
+/* Whether scopes 'x' and 'y' place the same symbols in the same slots.
+ * Formals built at runtime are new lvals each time, so compare names. */
+int lscope_same(lval *x, lval *y) {
+  if (x == y) {
+    return 1;
+  }
+  if (!x || !y || x->count != y->count) {
+    return 0;
+  }
+  for (int i = 0; i < x->count; i++) {
+    if (x->cell[i] != y->cell[i] &&
+        (ltype(x->cell[i]) != LVAL_SYM || ltype(y->cell[i]) != LVAL_SYM ||
+         x->cell[i]->sym != y->cell[i]->sym)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Whether code compiled into 'c' can run in 'e' */
+int lcode_fits(lcode *c, lenv *e) {
+  for (int i = 0; i < c->nscopes; i++, e = e->par) {
+    if (!e || !lscope_same(e->scope, c->scopes[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void lcode_compile_sexpr(lcode *c, lval *v, lenv *e, int *sp);
+
+void lcode_compile_expr(lcode *c, lval *v, lenv *e, int *sp) {
+  switch (ltype(v)) {
+  case LVAL_SYM: {
+    int slot;
+    int depth = lcode_resolve(c, e, v->sym, &slot);
+    if (depth >= 0) {
+      lcode_emit(c, OP_LOCAL);
+      lcode_emit(c, depth);
+      lcode_emit(c, slot);
+    } else {
+      lcode_emit(c, OP_LOAD);
+    }
+    lcode_emit(c, lcode_const(c, lval_ref(v)));
+    lcode_push(c, sp);
+    break;
+  }
+  case LVAL_SEXPR:
+    lcode_compile_sexpr(c, v, e, sp);
+    break;
+  default: {
+    /* Q-Expressions may be evaluated later so give them a placeholder */
+    lval *x = lval_ref(v);
+    if (ltype(x) == LVAL_QEXPR && !x->code) {
+      x->code = lcode_new();
+    }
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    lcode_push(c, sp);
+    break;
+  }
+  }
+}
+
+void lcode_compile_sexpr(lcode *c, lval *v, lenv *e, int *sp) {
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i], e, sp);
+  }
+  lcode_emit(c, OP_SEXPR);
+  lcode_emit(c, v->count);
+  *sp -= v->count;
+  lcode_push(c, sp);
+}
+
+/* Compile the contents of 'v' as an S-Expression into 'c', resolving
+ * symbols against the locals of 'e' */
+void lcode_compile(lcode *c, lval *v, lenv *e) {
+  int sp = 0;
+  lcode_compile_sexpr(c, v, e, &sp);
+  lcode_emit(c, OP_RET);
+}
+
+/* Virtual machine state. Lisp calls push frames onto 'frames' rather
+ * than recursing in C, and each frame keeps its working values on the
+ * shared 'stack'. Active VMs are chained, innermost first, so the
+ * collector can find everything they hold. */
+
+typedef struct lframe {
+  lenv *env;
+  lcode *code;
+  int pc;
+} lframe;
+
+typedef struct lvm {
+  struct lvm *prev;
+  int nframes;
+  int fcap;
+  lframe *frames;
+  int sp;
+  int scap;
+  lval **stack;
+} lvm;
+
+lvm *lvm_top = NULL;
+
+/* Garbage Collection */
+
+typedef void (*lvisit)(void *ctx, void *obj);
+
+/* Call 'fn' on each heap object referenced by 'h' */
+void lobj_visit(lhdr *h, lvisit fn, void *ctx) {
+  switch (h->kind) {
+  case LOBJ_VAL: {
+    lval *v = (lval *)(h + 1);
+    if (v->type == LVAL_FUN && !v->builtin) {
+      fn(ctx, v->env);
+      fn(ctx, v->formals);
+      fn(ctx, v->body);
+    }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      if (v->seq) {
+        fn(ctx, v->seq);
+      }
+      if (v->code) {
+        fn(ctx, v->code);
+      }
+    }
+    if (v->type == LVAL_MAP && v->map) {
+      fn(ctx, v->map);
+    }
+    if (v->type == LVAL_STR) {
+      fn(ctx, v->str);
+    }
+    break;
+  }
+  case LOBJ_ENV: {
+    lenv *e = (lenv *)(h + 1);
+    for (int i = 0; i < e->cap; i++) {
+      if (e->syms[i]) {
+        fn(ctx, e->vals[i]);
+      }
+    }
+    if (e->scope) {
+      fn(ctx, e->scope);
+      for (int i = 0; i < e->scope->count; i++) {
+        if (e->locals[i]) {
+          fn(ctx, e->locals[i]);
+        }
+      }
+    }
+    if (e->par) {
+      fn(ctx, e->par);
+    }
+    break;
+  }
+  case LOBJ_CODE: {
+    lcode *c = (lcode *)(h + 1);
+    for (int i = 0; i < c->nconsts; i++) {
+      fn(ctx, c->consts[i]);
+    }
+    for (int i = 0; i < c->nscopes; i++) {
+      if (c->scopes[i]) {
+        fn(ctx, c->scopes[i]);
+      }
+    }
+    if (c->alt) {
+      fn(ctx, c->alt);
+    }
+    break;
+  }
+  case LOBJ_SEQ: {
+    lseq *s = (lseq *)(h + 1);
+    for (int i = 0; i < s->used; i++) {
+      fn(ctx, s->items[i]);
+    }
+    break;
+  }
+  case LOBJ_MAP: {
+    lmap *m = (lmap *)(h + 1);
+    for (int i = 0; i < m->count; i++) {
+      if (m->entries[i].child) {
+        fn(ctx, m->entries[i].child);
+      } else {
+        fn(ctx, m->entries[i].key);
+        fn(ctx, m->entries[i].val);
+      }
+    }
+    break;
+  }
+  case LOBJ_STR: {
+    lstr *s = (lstr *)(h + 1);
+    if (s->depth) {
+      fn(ctx, s->left);
+      fn(ctx, s->right);
+    }
+    break;
+  }
+  }
+}
+
+/* Free the storage of 'h' without touching anything it references */
+void lobj_free(lhdr *h) {
+  switch (h->kind) {
+  case LOBJ_VAL: {
+    lval *v = (lval *)(h + 1);
+    if (v->type == LVAL_ERR) {
+      free(v->err);
+    }
+    if (v->type == LVAL_NUM) {
+      free(v->big.mag);
+    }
+    if (v->type == LVAL_VEC) {
+      free(v->vec.ints);
+      free(v->vec.flos);
+    }
+    break;
+  }
+  case LOBJ_ENV: {
+    lenv *e = (lenv *)(h + 1);
+    free(e->syms);
+    free(e->vals);
+    free(e->locals);
+    break;
+  }
+  case LOBJ_CODE: {
+    lcode *c = (lcode *)(h + 1);
+    free(c->ops);
+    free(c->consts);
+    free(c->scopes);
+    break;
+  }
+  case LOBJ_SEQ:
+    free(((lseq *)(h + 1))->items);
+    break;
+  case LOBJ_MAP:
+    free(((lmap *)(h + 1))->entries);
+    break;
+  case LOBJ_STR:
+    free(((lstr *)(h + 1))->data);
+    break;
+  }
+  lheap_free(h + 1);
+}
+
+typedef struct lgc {
+  int count;
+  int cap;
+  lhdr **stack;
+} lgc;
+
+void lgc_mark(void *ctx, void *obj) {
+  lgc *g = ctx;
+  if (LVAL_IMM(obj)) {
+    return;
+  }
+  lhdr *h = LHDR(obj);
+  if (h->mark) {
+    return;
+  }
+  h->mark = 1;
+
+  /* Children are marked from an explicit stack to bound C recursion */
+  if (g->count == g->cap) {
+    g->cap = g->cap ? g->cap * 2 : 256;
+    g->stack = realloc(g->stack, sizeof(lhdr *) * g->cap);
+  }
+  g->stack[g->count++] = h;
+}
+
+void lgc_release(void *ctx, void *obj) {
+  if (LVAL_IMM(obj)) {
+    return;
+  }
+  lhdr *h = LHDR(obj);
+  if (!h->mark) {
+    return;
+  }
+  if (h->kind == LOBJ_VAL) {
+    ((lval *)obj)->refs--;
+  }
+  if (h->kind == LOBJ_ENV) {
+    ((lenv *)obj)->refs--;
+  }
+  if (h->kind == LOBJ_CODE) {
+    ((lcode *)obj)->refs--;
+  }
+  if (h->kind == LOBJ_SEQ) {
+    ((lseq *)obj)->refs--;
+  }
+  if (h->kind == LOBJ_MAP) {
+    ((lmap *)obj)->refs--;
+  }
+  if (h->kind == LOBJ_STR) {
+    ((lstr *)obj)->refs--;
+  }
+}
+
+/* Mark everything reachable from the roots and VM stacks and free the
+ * rest. Only safe when no C code holds values outside of those, such as
+ * between top level forms. */
+void lheap_collect(void) {
+  clock_t start = clock();
+
+  lgc g = {0, 0, NULL};
+  for (int i = 0; i < lheap.nroots; i++) {
+    lgc_mark(&g, lheap.roots[i]);
+  }
+  for (lvm *vm = lvm_top; vm; vm = vm->prev) {
+    for (int i = 0; i < vm->nframes; i++) {
+      lgc_mark(&g, vm->frames[i].env);
+      lgc_mark(&g, vm->frames[i].code);
+    }
+    for (int i = 0; i < vm->sp; i++) {
+      lgc_mark(&g, vm->stack[i]);
+    }
+  }
+  while (g.count) {
+    lobj_visit(g.stack[--g.count], lgc_mark, &g);
+  }
+  free(g.stack);
+
+  /* Garbage gives up its references to live objects before being freed */
+  for (int k = 0; k < LOBJ_KINDS; k++) {
+    lpool *p = &lheap.pools[k];
+    for (lslab *s = p->slabs; s; s = s->next) {
+      for (int i = 0; i < LSLAB_CELLS; i++) {
+        lhdr *h = LSLAB_CELL(p, s, i);
+        if (h->kind != LOBJ_FREE && !h->mark) {
+          lobj_visit(h, lgc_release, NULL);
+        }
+      }
+    }
+  }
+
+  for (int k = 0; k < LOBJ_KINDS; k++) {
+    lpool *p = &lheap.pools[k];
+    for (lslab *s = p->slabs; s; s = s->next) {
+      for (int i = 0; i < LSLAB_CELLS; i++) {
+        lhdr *h = LSLAB_CELL(p, s, i);
+        if (h->kind == LOBJ_FREE) {
+          continue;
+        }
+        if (h->mark) {
+          h->mark = 0;
+        } else {
+          lobj_free(h);
+          lheap.stats.freed++;
+        }
+      }
+    }
+  }
+
+  long pause = (long)((clock() - start) * 1000000 / CLOCKS_PER_SEC);
+  lheap.stats.collections++;
+  lheap.stats.last_pause_us = pause;
+  lheap.stats.total_pause_us += pause;
+  if (pause > lheap.stats.max_pause_us) {
+    lheap.stats.max_pause_us = pause;
+  }
+
+  /* Let the heap double before the next collection */
+  lheap.threshold = lheap.stats.bytes * 2;
+  if (lheap.threshold < (1 << 20)) {
+    lheap.threshold = 1 << 20;
+  }
+}
+
+void lheap_safepoint(void) {
+  if (lheap.requested || lheap.stats.bytes > lheap.threshold) {
+    lheap.requested = 0;
+    lheap_collect();
+  }
+}
+
+/* Builtins */
+
+#define LASSERT(args, cond, fmt, ...)                                          \
+  if (!(cond)) {                                                               \
+    lval *err = lval_err(fmt, ##__VA_ARGS__);                                  \
+    lval_del(args);                                                            \
+    return err;                                                                \
+  }
+
+#define LASSERT_TYPE(func, args, index, expect)                                \
+  LASSERT(args, ltype(args->cell[index]) == expect,                             \
+          "Function '%s' passed incorrect type for argument %i. "              \
+          "Got %s, Expected %s.",                                              \
+          func, index, ltype_name(ltype(args->cell[index])),                    \
+          ltype_name(expect))
+
+#define LASSERT_NUMBER(func, args, index)                                      \
+  LASSERT(args,                                                                \
+          ltype(args->cell[index]) == LVAL_NUM ||                              \
+              ltype(args->cell[index]) == LVAL_FLO,                            \
+          "Function '%s' passed incorrect type for argument %i. "              \
+          "Got %s, Expected %s.",                                              \
+          func, index, ltype_name(ltype(args->cell[index])),                    \
+          ltype_name(LVAL_NUM))
+
+#define LASSERT_NUM(func, args, num)                                           \
+  LASSERT(args, args->count == num,                                            \
+          "Function '%s' passed incorrect number of arguments. "               \
+          "Got %i, Expected %i.",                                              \
+          func, args->count, num)
+
+#define LASSERT_NOT_EMPTY(func, args, index)                                   \
+  LASSERT(args, args->cell[index]->count != 0,                                 \
+          "Function '%s' passed {} for argument %i.", func, index);
+
+/* Integer arguments are printed in full, as they may be bignums */
+lval *lval_err_range(char *func, char *what, lval *x, char *expect,
+                     long limit) {
+  uint32_t buf[2];
+  char *got = lbig_str(lval_to_big(x, buf));
+  lval *err = lval_err("Function '%s' passed %s out of range. "
+                       "Got %s, Expected %s %li.",
+                       func, what, got, expect, limit);
+  free(got);
+  return err;
+}
+
+#define LASSERT_RANGE(func, args, index, what, cond, expect, limit)            \
+  if (!(cond)) {                                                               \
+    lval *err = lval_err_range(func, what, args->cell[index], expect, limit);  \
+    lval_del(args);                                                            \
+    return err;                                                                \
+  }
+
+lval *lval_eval(lenv *e, lval *v);
+lval *lval_run(lenv *e, lval *x);
+lcode *lval_code(lval *x, lenv *e);
+
+lval *builtin_lambda(lenv *e, lval *a) {
+  /* Check Two arguments, each of which are Q-Expressions */
+  LASSERT_NUM("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+  /* Check first Q-Expression contains only Symbols */
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (ltype(a->cell[0]->cell[i]) == LVAL_SYM),
+            "Cannot define non-symbol. Got %s, Expected %s.",
+            ltype_name(ltype(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  /* Pop first two arguments and pass them to lval_lambda */
+  lval *formals = lval_pop(a, 0);
+  lval *body = lval_pop(a, 0);
+  lval_del(a);
+
+  /* Resolve the body's variables now that its scopes are known */
+  lval *f = lval_lambda(e, formals, body);
+  lval_code(f->body, f->env);
+  return f;
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+/* Numeric comparisons, each a single test in builtin_cmp */
+enum { LCMP_GT, LCMP_LT, LCMP_EQ, LCMP_NE, LCMP_GE, LCMP_LE };
+
+char *lcmp_names[] = {">", "<", "==", "!=", ">=", "<="};
+
+lval *builtin_cmp_vec(lval *a, int op);
+
+/* Doubles are tested with 'op' itself rather than reduced to an order,
+ * so NaN is unordered: every test on it is false except != */
+int lcmp_flo(int op, double x, double y) {
+  switch (op) {
+  case LCMP_GT:
+    return x > y;
+  case LCMP_LT:
+    return x < y;
+  case LCMP_EQ:
+    return x == y;
+  case LCMP_NE:
+    return x != y;
+  case LCMP_GE:
+    return x >= y;
+  default:
+    return x <= y;
+  }
+}
+
+lval *builtin_cmp(lenv *e, lval *a, int op) {
+  char *func = lcmp_names[op];
+  LASSERT_NUM(func, a, 2);
+
+  /* Vectors compare elementwise */
+  if (ltype(a->cell[0]) == LVAL_VEC || ltype(a->cell[1]) == LVAL_VEC) {
+    return builtin_cmp_vec(a, op);
+  }
+
+  /* Strings compare by their bytes, anything else must be a number */
+  int str = ltype(a->cell[0]) == LVAL_STR && ltype(a->cell[1]) == LVAL_STR;
+  if (!str) {
+    LASSERT_NUMBER(func, a, 0);
+    LASSERT_NUMBER(func, a, 1);
+  }
+
+  /* Compare fixnums directly, promoting to double if either is a float
+   * and to bignums otherwise */
+  lval *x = a->cell[0];
+  lval *y = a->cell[1];
+  int c;
+  if (str) {
+    long n = x->len < y->len ? x->len : y->len;
+    c = memcmp(lval_str_data(x), lval_str_data(y), n);
+    c = c ? (c > 0) - (c < 0) : (x->len > y->len) - (x->len < y->len);
+  } else if (LVAL_FIX(x) && LVAL_FIX(y)) {
+    c = (lnum(x) > lnum(y)) - (lnum(x) < lnum(y));
+  } else if (ltype(x) == LVAL_FLO || ltype(y) == LVAL_FLO) {
+    int r = lcmp_flo(op, lval_to_flo(x), lval_to_flo(y));
+    lval_del(a);
+    return lval_bool(r);
+  } else {
+    uint32_t xb[2], yb[2];
+    c = lbig_cmp(lval_to_big(x, xb), lval_to_big(y, yb));
+  }
+  lval_del(a);
+
+  /* Booleans are immediates so the result needs no allocation */
+  switch (op) {
+  case LCMP_GT:
+    return lval_bool(c > 0);
+  case LCMP_LT:
+    return lval_bool(c < 0);
+  case LCMP_EQ:
+    return lval_bool(c == 0);
+  case LCMP_NE:
+    return lval_bool(c != 0);
+  case LCMP_GE:
+    return lval_bool(c >= 0);
+  default:
+    return lval_bool(c <= 0);
+  }
+}
+
+lval *builtin_gt(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_GT); }
+lval *builtin_lt(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_LT); }
+lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_EQ); }
+lval *builtin_uneq(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_NE); }
+lval *builtin_ge(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_GE); }
+lval *builtin_le(lenv *e, lval *a) { return builtin_cmp(e, a, LCMP_LE); }
+
+lval *builtin_head(lenv *e, lval *a) {
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("head", a, 0);
+
+  lval *v = lval_slice(a->cell[0], 0, 1);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_tail(lenv *e, lval *a) {
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("tail", a, 0);
+
+  lval *q = a->cell[0];
+  lval *v = lval_slice(q, 1, q->count - 1);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_nth(lenv *e, lval *a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("nth", a, 1, LVAL_NUM);
+
+  /* Elements are stored contiguously so indexing is O(1). A bignum is
+   * never in range, so it is read as -1 */
+  long i = LVAL_FIX(a->cell[1]) ? lnum(a->cell[1]) : -1;
+  LASSERT_RANGE("nth", a, 1, "index", i >= 0 && i < a->cell[0]->count,
+                "below", (long)a->cell[0]->count);
+
+  lval *x = lval_ref(a->cell[0]->cell[i]);
+  lval_del(a);
+  return x;
+}
+
+/* 'eval' and 'if' are special, they return the Q-Expression for the
+ * evaluator to run in their place */
+
+lval *builtin_eval(lenv *e, lval *a) {
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  return lval_take(a, 0);
+}
+
+lval *builtin_if(lenv *e, lval *a) {
+  LASSERT_NUM("if", a, 3);
+  LASSERT_TYPE("if", a, 0, LVAL_BOOL);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  /* Take the chosen branch, deleting the rest of the arguments */
+  return lval_take(a, lbool(a->cell[0]) ? 1 : 2);
+}
+
+/* Strings join in place or as a rope, see lval_str_join */
+lval *builtin_join_str(lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("join", a, i, LVAL_STR);
+  }
+
+  lval *x = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    x = lval_str_join(x, lval_ref(a->cell[i]));
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+
+  if (a->count && ltype(a->cell[0]) == LVAL_STR) {
+    return builtin_join_str(a);
+  }
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+  }
+
+  lval *x = lval_own(lval_pop(a, 0));
+
+  /* Size the result once up front */
+  int total = x->count;
+  for (int i = 0; i < a->count; i++) {
+    total += a->cell[i]->count;
+  }
+  lval_reserve(x, total);
+
+  /* The rest stay in 'a', which is deleted once they are copied over */
+  for (int i = 0; i < a->count; i++) {
+    x = lval_join(x, lval_ref(a->cell[i]));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+/* Arithmetic operators, each with its own loop in builtin_op */
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV };
+
+char *lop_names[] = {"+", "-", "*", "/"};
+
+/* Whether x * y of two fixnums is also a fixnum */
+int lfix_mul_ok(long x, long y) {
+  if (x == 0 || y == 0) {
+    return 1;
+  }
+  unsigned long ax = x < 0 ? -(unsigned long)x : (unsigned long)x;
+  unsigned long ay = y < 0 ? -(unsigned long)y : (unsigned long)y;
+  return ax <= LFIX_MAX / ay;
+}
+
+/* Continue 'op' from 'acc' over cell[i..n) in arbitrary precision */
+lval *builtin_op_big(lval *a, int op, lbig acc, int i) {
+  for (; i < a->count; i++) {
+    uint32_t buf[2];
+    lbig y = lval_to_big(a->cell[i], buf);
+    lbig r;
+    switch (op) {
+    case LOP_ADD:
+      r = lbig_add(acc, y, 0);
+      break;
+    case LOP_SUB:
+      r = lbig_add(acc, y, 1);
+      break;
+    case LOP_MUL:
+      r = lbig_mul(acc, y);
+      break;
+    default:
+      if (y.len == 0) {
+        free(acc.mag);
+        lval_del(a);
+        return lval_err("Division By Zero.");
+      }
+      r = lbig_div(acc, y);
+      break;
+    }
+    free(acc.mag);
+    acc = r;
+  }
+  lval_del(a);
+  return lval_big(acc);
+}
+
+/* Apply 'op' over the arguments as doubles */
+lval *builtin_op_flo(lval *a, int op) {
+  int n = a->count;
+  double acc = lval_to_flo(a->cell[0]);
+
+  if (op == LOP_SUB && n == 1) {
+    acc = -acc;
+  }
+  for (int i = 1; i < n; i++) {
+    double y = lval_to_flo(a->cell[i]);
+    switch (op) {
+    case LOP_ADD:
+      acc += y;
+      break;
+    case LOP_SUB:
+      acc -= y;
+      break;
+    case LOP_MUL:
+      acc *= y;
+      break;
+    case LOP_DIV:
+      if (y == 0) {
+        lval_del(a);
+        return lval_err("Division By Zero.");
+      }
+      acc /= y;
+      break;
+    }
+  }
+
+  lval_del(a);
+  return lval_flo(acc);
+}
+
+lval *builtin_op_vec(lval *a, int op);
+
+lval *builtin_op(lenv *e, lval *a, int op) {
+
+  int flo = 0;
+  int vec = 0;
+  for (int i = 0; i < a->count; i++) {
+    if (ltype(a->cell[i]) == LVAL_VEC) {
+      vec = 1;
+      continue;
+    }
+    LASSERT_NUMBER(lop_names[op], a, i);
+    flo |= ltype(a->cell[i]) == LVAL_FLO;
+  }
+
+  /* Vectors apply the operator elementwise */
+  if (vec) {
+    return builtin_op_vec(a, op);
+  }
+
+  /* Any float makes the whole operation floating point */
+  if (flo) {
+    return builtin_op_flo(a, op);
+  }
+
+  /* Accumulate unboxed while everything stays a fixnum, finishing in
+   * arbitrary precision from the first operand where it does not */
+  int n = a->count;
+  lval **cell = a->cell;
+  int i = 1;
+  long acc = 0;
+
+  /* Unary minus negates */
+  if (op == LOP_SUB && n == 1) {
+    lval *x;
+    if (LVAL_FIX(cell[0])) {
+      x = lval_num(-lnum(cell[0]));
+    } else {
+      /* Negating can bring a bignum into fixnum range, so demote */
+      lbig b = cell[0]->big;
+      lbig r = lbig_new(!b.neg, b.len);
+      memcpy(r.mag, b.mag, sizeof(uint32_t) * b.len);
+      x = lval_big(r);
+    }
+    lval_del(a);
+    return x;
+  }
+
+  if (LVAL_FIX(cell[0])) {
+    acc = lnum(cell[0]);
+
+    switch (op) {
+    case LOP_ADD:
+      for (; i < n && LVAL_FIX(cell[i]); i++) {
+        long r = acc + lnum(cell[i]);
+        if (r < LFIX_MIN || r > LFIX_MAX) {
+          break;
+        }
+        acc = r;
+      }
+      break;
+    case LOP_SUB:
+      for (; i < n && LVAL_FIX(cell[i]); i++) {
+        long r = acc - lnum(cell[i]);
+        if (r < LFIX_MIN || r > LFIX_MAX) {
+          break;
+        }
+        acc = r;
+      }
+      break;
+    case LOP_MUL:
+      for (; i < n && LVAL_FIX(cell[i]); i++) {
+        if (!lfix_mul_ok(acc, lnum(cell[i]))) {
+          break;
+        }
+        acc *= lnum(cell[i]);
+      }
+      break;
+    case LOP_DIV:
+      for (; i < n && LVAL_FIX(cell[i]); i++) {
+        long d = lnum(cell[i]);
+        if (d == 0) {
+          lval_del(a);
+          return lval_err("Division By Zero.");
+        }
+        if (acc == LFIX_MIN && d == -1) {
+          break;
+        }
+        acc /= d;
+      }
+      break;
+    }
+
+    if (i == n) {
+      lval_del(a);
+      return lval_num(acc);
+    }
+  }
+
+  uint32_t buf[2];
+  lbig x = LVAL_FIX(cell[0]) ? lbig_view(acc, buf) : cell[0]->big;
+  lbig big = lbig_new(x.neg, x.len);
+  memcpy(big.mag, x.mag, sizeof(uint32_t) * x.len);
+  return builtin_op_big(a, op, big, i);
+}
+
+lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, LOP_ADD); }
+lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, LOP_SUB); }
+lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, LOP_MUL); }
+lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, LOP_DIV); }
+
+/* Packed Vectors */
+
+/* Vector loops run straight over the packed arrays, written so the
+ * compiler can vectorise them. Integer elements stay in the fixnum
+ * range and results that would leave it are reported, not wrapped. */
+
+/* Exact sum of fixnum range integers. Each is split into its high and
+ * low 31 bits, summed separately so neither total can overflow. */
+lval *lvec_isum(long *x, int n) {
+  long hi = 0;
+  long lo = 0;
+  for (int i = 0; i < n; i++) {
+    hi += x[i] >> 31;
+    lo += x[i] & 0x7FFFFFFF;
+  }
+  if (hi >= -(1L << 29) && hi <= (1L << 29) && lo < (1L << 60)) {
+    return lval_num(hi * (1L << 31) + lo);
+  }
+  uint32_t hb[2], sb[2], lb[2];
+  lbig h = lbig_mul(lbig_view(hi, hb), lbig_view(1L << 31, sb));
+  lbig r = lbig_add(h, lbig_view(lo, lb), 0);
+  free(h.mag);
+  return lval_big(r);
+}
+
+/* Independent accumulators let the additions run side by side */
+double lvec_fsum(double *x, int n) {
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i];
+    s1 += x[i + 1];
+    s2 += x[i + 2];
+    s3 += x[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += x[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+double lvec_fdot(double *x, double *y, int n) {
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i] * y[i];
+    s1 += x[i + 1] * y[i + 1];
+    s2 += x[i + 2] * y[i + 2];
+    s3 += x[i + 3] * y[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += x[i] * y[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+/* Whether every element of 'x' lies within [lo, hi] */
+int lvec_within(const long *x, int n, long lo, long hi) {
+  long min = 0;
+  long max = 0;
+  for (int i = 0; i < n; i++) {
+    min = x[i] < min ? x[i] : min;
+    max = x[i] > max ? x[i] : max;
+  }
+  return min >= lo && max <= hi;
+}
+
+/* 'v' as 'n' doubles, repeating a scalar. An array that has to be
+ * built is also stored in '*tmp' for the caller to free. */
+double *lvec_flos(lval *v, int n, double **tmp) {
+  if (ltype(v) == LVAL_VEC && v->vec.flo) {
+    return v->vec.flos;
+  }
+  double *t = *tmp = calloc(n > 0 ? n : 1, sizeof(double));
+  if (ltype(v) == LVAL_VEC) {
+    for (int i = 0; i < n; i++) {
+      t[i] = (double)v->vec.ints[i];
+    }
+  } else {
+    double d = lval_to_flo(v);
+    for (int i = 0; i < n; i++) {
+      t[i] = d;
+    }
+  }
+  return t;
+}
+
+/* 'v' as 'n' integers, repeating a fixnum */
+long *lvec_ints(lval *v, int n, long **tmp) {
+  if (ltype(v) == LVAL_VEC) {
+    return v->vec.ints;
+  }
+  long *t = *tmp = calloc(n > 0 ? n : 1, sizeof(long));
+  long x = lnum(v);
+  for (int i = 0; i < n; i++) {
+    t[i] = x;
+  }
+  return t;
+}
+
+/* Check 'x' and 'y' combine elementwise, giving the length and whether
+ * the result is floating point. Returns an error if not. */
+lval *lvec_check(char *func, lval *x, lval *y, int *n, int *flo) {
+  lval *v[2] = {x, y};
+  *n = -1;
+  *flo = 0;
+  for (int k = 0; k < 2; k++) {
+    if (ltype(v[k]) == LVAL_VEC) {
+      if (*n >= 0 && *n != v[k]->vec.len) {
+        return lval_err("Function '%s' passed vectors of different lengths. "
+                        "Got %i and %i.",
+                        func, *n, v[k]->vec.len);
+      }
+      *n = v[k]->vec.len;
+      *flo |= v[k]->vec.flo;
+    } else if (ltype(v[k]) == LVAL_FLO) {
+      *flo = 1;
+    } else if (!LVAL_FIX(v[k])) {
+      return lval_err("Function '%s' cannot apply a bignum to a vector.",
+                      func);
+    }
+  }
+  return NULL;
+}
+
+/* Run 'stmt' for each index 'i' below 'n'. At -O2 gcc only vectorizes
+ * loops with a known trip count, so whole blocks of LVEC_BLOCK are run by
+ * a fixed inner loop and the remainder one at a time. */
+#define LVEC_BLOCK 4
+#define LVEC_EACH(i, n, stmt)                                                  \
+  for (int i##0 = 0; i##0 + LVEC_BLOCK <= (n); i##0 += LVEC_BLOCK) {           \
+    for (int i##1 = 0; i##1 < LVEC_BLOCK; i##1++) {                            \
+      int i = i##0 + i##1;                                                     \
+      stmt;                                                                    \
+    }                                                                          \
+  }                                                                            \
+  for (int i = (n) / LVEC_BLOCK * LVEC_BLOCK; i < (n); i++) {                  \
+    stmt;                                                                      \
+  }
+
+/* The elementwise loops take restrict parameters so they need no
+ * runtime alias checks. 'a' and 'b' are only read, so they may be the
+ * same array. Returns whether any divisor was zero. */
+int lvec_fop(int op, double *restrict c, const double *restrict a,
+             const double *restrict b, int n) {
+  int zero = 0;
+  switch (op) {
+  case LOP_ADD:
+    LVEC_EACH(i, n, c[i] = a[i] + b[i]);
+    break;
+  case LOP_SUB:
+    LVEC_EACH(i, n, c[i] = a[i] - b[i]);
+    break;
+  case LOP_MUL:
+    LVEC_EACH(i, n, c[i] = a[i] * b[i]);
+    break;
+  case LOP_DIV:
+    for (int i = 0; i < n; i++) {
+      zero |= b[i] == 0;
+    }
+    LVEC_EACH(i, n, c[i] = a[i] / b[i]);
+    break;
+  }
+  return zero;
+}
+
+/* As lvec_fop for integers, also setting '*over' if a product may have
+ * left the fixnum range. Sums, differences and quotients of fixnums fit
+ * a long, so the caller checks those against the range afterwards. */
+int lvec_iop(int op, long *restrict c, const long *restrict a,
+             const long *restrict b, int n, int *over) {
+  int zero = 0;
+  switch (op) {
+  case LOP_ADD:
+    LVEC_EACH(i, n, c[i] = a[i] + b[i]);
+    break;
+  case LOP_SUB:
+    LVEC_EACH(i, n, c[i] = a[i] - b[i]);
+    break;
+  case LOP_MUL: {
+    /* Products of 31 bit elements fit a long, otherwise each product
+     * is checked */
+    long lim = 0x7FFFFFFF;
+    if (lvec_within(a, n, -lim, lim) && lvec_within(b, n, -lim, lim)) {
+      LVEC_EACH(i, n, c[i] = a[i] * b[i]);
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      *over |= !lfix_mul_ok(a[i], b[i]);
+      c[i] = (long)((unsigned long)a[i] * (unsigned long)b[i]);
+    }
+    break;
+  }
+  case LOP_DIV:
+    for (int i = 0; i < n; i++) {
+      zero |= b[i] == 0;
+      c[i] = b[i] ? a[i] / b[i] : 0;
+    }
+    break;
+  }
+  return zero;
+}
+
+/* Set each c[i] to comparison 'op' of a[i] and b[i]. Each operator is
+ * its own test, so an element compared with NaN is false except by != */
+#define LVEC_CMP(op, c, a, b, n)                                               \
+  switch (op) {                                                                \
+  case LCMP_GT:                                                                \
+    LVEC_EACH(i, n, c[i] = a[i] > b[i]);                                       \
+    break;                                                                     \
+  case LCMP_LT:                                                                \
+    LVEC_EACH(i, n, c[i] = a[i] < b[i]);                                       \
+    break;                                                                     \
+  case LCMP_EQ:                                                                \
+    LVEC_EACH(i, n, c[i] = a[i] == b[i]);                                      \
+    break;                                                                     \
+  case LCMP_NE:                                                                \
+    LVEC_EACH(i, n, c[i] = a[i] != b[i]);                                      \
+    break;                                                                     \
+  case LCMP_GE:                                                                \
+    LVEC_EACH(i, n, c[i] = a[i] >= b[i]);                                      \
+    break;                                                                     \
+  default:                                                                     \
+    LVEC_EACH(i, n, c[i] = a[i] <= b[i]);                                      \
+  }
+
+void lvec_fcmp(int op, long *restrict c, const double *restrict a,
+               const double *restrict b, int n) {
+  LVEC_CMP(op, c, a, b, n);
+}
+
+void lvec_icmp(int op, long *restrict c, const long *restrict a,
+               const long *restrict b, int n) {
+  LVEC_CMP(op, c, a, b, n);
+}
+
+/* Apply arithmetic 'op' elementwise, with at least one of 'x' and 'y'
+ * a vector and the other repeated if not */
+lval *lvec_op(int op, lval *x, lval *y) {
+  int n, flo;
+  lval *err = lvec_check(lop_names[op], x, y, &n, &flo);
+  if (err) {
+    return err;
+  }
+
+  lval *r = lval_vec(n, flo);
+  int zero;
+  int over = 0;
+
+  if (flo) {
+    double *xt = NULL, *yt = NULL;
+    double *a = lvec_flos(x, n, &xt);
+    double *b = lvec_flos(y, n, &yt);
+    zero = lvec_fop(op, r->vec.flos, a, b, n);
+    free(xt);
+    free(yt);
+  } else {
+    long *xt = NULL, *yt = NULL;
+    long *a = lvec_ints(x, n, &xt);
+    long *b = lvec_ints(y, n, &yt);
+    zero = lvec_iop(op, r->vec.ints, a, b, n, &over);
+    over |= !lvec_within(r->vec.ints, n, LFIX_MIN, LFIX_MAX);
+    free(xt);
+    free(yt);
+  }
+
+  if (zero) {
+    lval_del(r);
+    return lval_err("Division By Zero.");
+  }
+  if (over) {
+    lval_del(r);
+    return lval_err("Function '%s' overflowed a vector element.",
+                    lop_names[op]);
+  }
+  return r;
+}
+
+/* Fold 'op' over arguments including a vector */
+lval *builtin_op_vec(lval *a, int op) {
+  if (op == LOP_SUB && a->count == 1) {
+    lval *r = lvec_op(LOP_SUB, lval_num(0), a->cell[0]);
+    lval_del(a);
+    return r;
+  }
+
+  lval *acc = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    lval *y = a->cell[i];
+    lval *r;
+    if (ltype(acc) == LVAL_VEC || ltype(y) == LVAL_VEC) {
+      r = lvec_op(op, acc, y);
+      lval_del(acc);
+    } else {
+      /* Numbers before the first vector combine as usual */
+      lval *pair = lval_sexpr();
+      lval_add(pair, acc);
+      lval_add(pair, lval_ref(y));
+      r = builtin_op(NULL, pair, op);
+    }
+    if (ltype(r) == LVAL_ERR) {
+      lval_del(a);
+      return r;
+    }
+    acc = r;
+  }
+  lval_del(a);
+  return acc;
+}
+
+/* Compare elementwise, giving a vector of ones and zeros */
+lval *builtin_cmp_vec(lval *a, int op) {
+  char *func = lcmp_names[op];
+  for (int k = 0; k < 2; k++) {
+    if (ltype(a->cell[k]) != LVAL_VEC) {
+      LASSERT_NUMBER(func, a, k);
+    }
+  }
+
+  int n, flo;
+  lval *err = lvec_check(func, a->cell[0], a->cell[1], &n, &flo);
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+
+  lval *r = lval_vec(n, 0);
+  if (flo) {
+    double *xt = NULL, *yt = NULL;
+    double *x = lvec_flos(a->cell[0], n, &xt);
+    double *y = lvec_flos(a->cell[1], n, &yt);
+    lvec_fcmp(op, r->vec.ints, x, y, n);
+    free(xt);
+    free(yt);
+  } else {
+    long *xt = NULL, *yt = NULL;
+    long *x = lvec_ints(a->cell[0], n, &xt);
+    long *y = lvec_ints(a->cell[1], n, &yt);
+    lvec_icmp(op, r->vec.ints, x, y, n);
+    free(xt);
+    free(yt);
+  }
+
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_vec(lenv *e, lval *a) {
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval *q = a->cell[0];
+  int flo = 0;
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, LVAL_FIX(q->cell[i]) || ltype(q->cell[i]) == LVAL_FLO,
+            "Function 'vec' cannot pack element %i. "
+            "Got %s, Expected a fixnum or float.",
+            i, ltype_name(ltype(q->cell[i])));
+    flo |= ltype(q->cell[i]) == LVAL_FLO;
+  }
+
+  lval *v = lval_vec(q->count, flo);
+  for (int i = 0; i < q->count; i++) {
+    if (flo) {
+      v->vec.flos[i] = lval_to_flo(q->cell[i]);
+    } else {
+      v->vec.ints[i] = lnum(q->cell[i]);
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_unvec(lenv *e, lval *a) {
+  LASSERT_NUM("unvec", a, 1);
+  LASSERT_TYPE("unvec", a, 0, LVAL_VEC);
+
+  lvec *v = &a->cell[0]->vec;
+  lval *q = lval_qexpr();
+  lval_reserve(q, v->len);
+  for (int i = 0; i < v->len; i++) {
+    lval_add(q, v->flo ? lval_flo(v->flos[i]) : lval_num(v->ints[i]));
+  }
+  lval_del(a);
+  return q;
+}
+
+lval *builtin_sum(lenv *e, lval *a) {
+  LASSERT_NUM("sum", a, 1);
+  LASSERT_TYPE("sum", a, 0, LVAL_VEC);
+
+  lvec *v = &a->cell[0]->vec;
+  lval *r = v->flo ? lval_flo(lvec_fsum(v->flos, v->len))
+                   : lvec_isum(v->ints, v->len);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_prod(lenv *e, lval *a) {
+  LASSERT_NUM("prod", a, 1);
+  LASSERT_TYPE("prod", a, 0, LVAL_VEC);
+
+  lvec *v = &a->cell[0]->vec;
+  if (v->flo) {
+    double p = 1;
+    for (int i = 0; i < v->len; i++) {
+      p *= v->flos[i];
+    }
+    lval_del(a);
+    return lval_flo(p);
+  }
+
+  /* Integer products soon overflow so let '*' promote them */
+  lval *x = lval_sexpr();
+  lval_reserve(x, v->len + 1);
+  lval_add(x, lval_num(1));
+  for (int i = 0; i < v->len; i++) {
+    lval_add(x, lval_num(v->ints[i]));
+  }
+  lval_del(a);
+  return builtin_op(e, x, LOP_MUL);
+}
+
+lval *builtin_extreme(lenv *e, lval *a, char *func, int max) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+  LASSERT(a, a->cell[0]->vec.len > 0, "Function '%s' passed an empty vector.",
+          func);
+
+  lvec *v = &a->cell[0]->vec;
+  lval *r;
+  if (v->flo) {
+    double m = v->flos[0];
+    for (int i = 1; i < v->len; i++) {
+      double x = v->flos[i];
+      m = (max ? x > m : x < m) ? x : m;
+    }
+    r = lval_flo(m);
+  } else {
+    long m = v->ints[0];
+    for (int i = 1; i < v->len; i++) {
+      long x = v->ints[i];
+      m = (max ? x > m : x < m) ? x : m;
+    }
+    r = lval_num(m);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_min(lenv *e, lval *a) { return builtin_extreme(e, a, "min", 0); }
+lval *builtin_max(lenv *e, lval *a) { return builtin_extreme(e, a, "max", 1); }
+
+lval *builtin_dot(lenv *e, lval *a) {
+  LASSERT_NUM("dot", a, 2);
+  LASSERT_TYPE("dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("dot", a, 1, LVAL_VEC);
+
+  int n, flo;
+  lval *r = lvec_check("dot", a->cell[0], a->cell[1], &n, &flo);
+  if (r) {
+    lval_del(a);
+    return r;
+  }
+
+  if (flo) {
+    double *xt = NULL, *yt = NULL;
+    double *x = lvec_flos(a->cell[0], n, &xt);
+    double *y = lvec_flos(a->cell[1], n, &yt);
+    r = lval_flo(lvec_fdot(x, y, n));
+    free(xt);
+    free(yt);
+    lval_del(a);
+    return r;
+  }
+
+  long *x = a->cell[0]->vec.ints;
+  long *y = a->cell[1]->vec.ints;
+  long lim = 0x7FFFFFFF;
+  if (lvec_within(x, n, -lim, lim) && lvec_within(y, n, -lim, lim)) {
+    /* Products of 31 bit elements fit a fixnum so sum exactly */
+    long *p = malloc(sizeof(long) * (n > 0 ? n : 1));
+    for (int i = 0; i < n; i++) {
+      p[i] = x[i] * y[i];
+    }
+    r = lvec_isum(p, n);
+    free(p);
+  } else {
+    lbig acc = lbig_new(0, 0);
+    for (int i = 0; i < n; i++) {
+      uint32_t xb[2], yb[2];
+      lbig t = lbig_mul(lbig_view(x[i], xb), lbig_view(y[i], yb));
+      lbig s = lbig_add(acc, t, 0);
+      free(t.mag);
+      free(acc.mag);
+      acc = s;
+    }
+    r = lval_big(acc);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* Hash argument 'i' of 'a' into '*h', or describe why it is not a key */
+lval *lmap_key(char *func, lval *a, int i, uint32_t *h) {
+  int ok = 1;
+  *h = lval_hash(a->cell[i], &ok);
+  if (!ok) {
+    return lval_err("Function '%s' cannot use %s as a key.", func,
+                    ltype_name(ltype(a->cell[i])));
+  }
+  return NULL;
+}
+
+/* Bind pairs of keys and values in 'a' from 'i' into map 'm' */
+lval *lmap_assoc_all(char *func, lval *m, lval *a, int i) {
+  for (; i + 1 < a->count; i += 2) {
+    uint32_t h;
+    lval *err = lmap_key(func, a, i, &h);
+    if (err) {
+      lval_del(m);
+      return err;
+    }
+    int added = 0;
+    lmap *r = lmap_assoc(m->map, h, a->cell[i], a->cell[i + 1], 0, &added);
+    if (m->map) {
+      lmap_del(m->map);
+    }
+    m->map = r;
+    m->size += added;
+  }
+  return m;
+}
+
+lval *builtin_hash_map(lenv *e, lval *a) {
+  LASSERT_NUM("hash-map", a, 1);
+  LASSERT_TYPE("hash-map", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count % 2 == 0,
+          "Function 'hash-map' passed a key without a value. "
+          "Got %i elements, Expected an even number.",
+          a->cell[0]->count);
+
+  lval *m = lmap_assoc_all("hash-map", lval_map(NULL, 0), a->cell[0], 0);
+  lval_del(a);
+  return m;
+}
+
+lval *builtin_get(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'get' passed incorrect number of arguments. "
+          "Got %i, Expected 2 or 3.",
+          a->count);
+  LASSERT_TYPE("get", a, 0, LVAL_MAP);
+
+  uint32_t h;
+  lval *err = lmap_key("get", a, 1, &h);
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+
+  /* Missing keys give the default if there is one */
+  lval *v = lmap_get(a->cell[0]->map, h, a->cell[1]);
+  LASSERT(a, v || a->count == 3, "Function 'get' passed a key not in the map.");
+  v = lval_ref(v ? v : a->cell[2]);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_has(lenv *e, lval *a) {
+  LASSERT_NUM("has", a, 2);
+  LASSERT_TYPE("has", a, 0, LVAL_MAP);
+
+  uint32_t h;
+  lval *err = lmap_key("has", a, 1, &h);
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+  lval *v = lval_bool(lmap_get(a->cell[0]->map, h, a->cell[1]) != NULL);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_assoc(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 3 && a->count % 2 == 1,
+          "Function 'assoc' passed incorrect number of arguments. "
+          "Got %i, Expected a map then pairs of keys and values.",
+          a->count);
+  LASSERT_TYPE("assoc", a, 0, LVAL_MAP);
+
+  lval *m = a->cell[0];
+  m = lmap_assoc_all("assoc", lval_map(m->map ? lmap_ref(m->map) : NULL,
+                                       m->size), a, 1);
+  lval_del(a);
+  return m;
+}
+
+lval *builtin_dissoc(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 2,
+          "Function 'dissoc' passed incorrect number of arguments. "
+          "Got %i, Expected at least 2.",
+          a->count);
+  LASSERT_TYPE("dissoc", a, 0, LVAL_MAP);
+
+  lval *m = a->cell[0];
+  m = lval_map(m->map ? lmap_ref(m->map) : NULL, m->size);
+  for (int i = 1; i < a->count; i++) {
+    uint32_t h;
+    lval *err = lmap_key("dissoc", a, i, &h);
+    if (err) {
+      lval_del(m);
+      lval_del(a);
+      return err;
+    }
+    if (!m->map) {
+      continue;
+    }
+    int removed = 0;
+    lmap *r = lmap_dissoc(m->map, h, a->cell[i], 0, &removed);
+    lmap_del(m->map);
+    m->map = r;
+    m->size -= removed;
+  }
+  lval_del(a);
+  return m;
+}
+
+void lmap_add_key(void *q, lval *k, lval *v) { lval_add(q, lval_ref(k)); }
+void lmap_add_val(void *q, lval *k, lval *v) { lval_add(q, lval_ref(v)); }
+
+lval *builtin_entries(lenv *e, lval *a, char *func, lmap_fn fn) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_MAP);
+
+  lval *q = lval_qexpr();
+  lval_reserve(q, a->cell[0]->size);
+  lmap_each(a->cell[0]->map, fn, q);
+  lval_del(a);
+  return q;
+}
+
+lval *builtin_keys(lenv *e, lval *a) {
+  return builtin_entries(e, a, "keys", lmap_add_key);
+}
+
+lval *builtin_vals(lenv *e, lval *a) {
+  return builtin_entries(e, a, "vals", lmap_add_val);
+}
+
+lval *builtin_len(lenv *e, lval *a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_STR);
+
+  lval *x = lval_num(a->cell[0]->len);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_substr(lenv *e, lval *a) {
+  LASSERT_NUM("substr", a, 3);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+  LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+
+  /* Substrings share the bytes of the string they come from */
+  long len = a->cell[0]->len;
+  long i = LVAL_FIX(a->cell[1]) ? lnum(a->cell[1]) : -1;
+  long n = LVAL_FIX(a->cell[2]) ? lnum(a->cell[2]) : -1;
+  LASSERT_RANGE("substr", a, 1, "start", i >= 0 && i <= len, "at most", len);
+  LASSERT_RANGE("substr", a, 2, "length", n >= 0 && n <= len - i, "at most",
+                len - i);
+
+  lval *x = lval_str_slice(a->cell[0], i, n);
+  lval_del(a);
+  return x;
+}
+
+/* Offset of the first 'sep' in the 'n' bytes at 'p', or -1 */
+long lstr_find(char *p, long n, char *sep, long m) {
+  if (m == 0) {
+    return 0;
+  }
+  for (char *q = p; n - (q - p) >= m; q++) {
+    q = memchr(q, sep[0], n - (q - p) - m + 1);
+    if (!q) {
+      return -1;
+    }
+    if (memcmp(q, sep, m) == 0) {
+      return q - p;
+    }
+  }
+  return -1;
+}
+
+lval *builtin_find(lenv *e, lval *a) {
+  LASSERT_NUM("find", a, 2);
+  LASSERT_TYPE("find", a, 0, LVAL_STR);
+  LASSERT_TYPE("find", a, 1, LVAL_STR);
+
+  lval *s = a->cell[0];
+  lval *t = a->cell[1];
+  lval *x = lval_num(
+      lstr_find(lval_str_data(s), s->len, lval_str_data(t), t->len));
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_split(lenv *e, lval *a) {
+  LASSERT_NUM("split", a, 2);
+  LASSERT_TYPE("split", a, 0, LVAL_STR);
+  LASSERT_TYPE("split", a, 1, LVAL_STR);
+  LASSERT(a, a->cell[1]->len > 0, "Function 'split' passed an empty separator.");
+
+  /* Each piece is a slice of the original, so nothing is copied */
+  lval *s = a->cell[0];
+  lval *t = a->cell[1];
+  char *p = lval_str_data(s);
+  char *sep = lval_str_data(t);
+  lval *q = lval_qexpr();
+  long i = 0;
+  while (1) {
+    long j = lstr_find(p + i, s->len - i, sep, t->len);
+    if (j < 0) {
+      break;
+    }
+    q = lval_add(q, lval_str_slice(s, i, j));
+    i += j + t->len;
+  }
+  q = lval_add(q, lval_str_slice(s, i, s->len - i));
+  lval_del(a);
+  return q;
+}
+
+lval *lval_load(lenv *e, char *path, int echo, int safepoints);
+
+lval *builtin_load(lenv *e, lval *a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  /* Strings are not NUL terminated */
+  lval *s = a->cell[0];
+  char *path = malloc(s->len + 1);
+  memcpy(path, lval_str_data(s), s->len);
+  path[s->len] = '\0';
+  lval_del(a);
+
+  /* Collection must wait for the form that called 'load' to finish */
+  lval *x = lval_load(e, path, 0, 0);
+  free(path);
   return x;
 }
 
-lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
-lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
-lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
-lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, "/"); }
-
 lval *builtin_var(lenv *e, lval *a, char *func) {
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
   lval *syms = a->cell[0];
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (ltype(syms->cell[i]) == LVAL_SYM),
             "Function '%s' cannot define non-symbol. "
             "Got %s, Expected %s.",
-            func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+            func, ltype_name(ltype(syms->cell[i])), ltype_name(LVAL_SYM));
   }
 
   LASSERT(a, (syms->count == a->count - 1),
@@ -663,24 +3789,69 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
           "Got %i, Expected %i.",
           func, syms->count, a->count - 1);
 
+  /* If 'def' define in globally. If 'put' define in locally */
+  lenv *target = func == lsym_def ? lenv_root(e) : e;
+
   for (int i = 0; i < syms->count; i++) {
-    /* If 'def' define in globally. If 'put' define in locally */
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i + 1]);
-    }
+    lenv_put(target, syms->cell[i], a->cell[i + 1]);
+  }
 
-    if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
-    }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Takes a single ignored argument, as '(heap)' alone evaluates to the
+ * function itself */
+lval *builtin_heap(lenv *e, lval *a) {
+  LASSERT_NUM("heap", a, 1);
+  lval_del(a);
+
+  /* {objects bytes collections freed last-pause max-pause total-pause} */
+  lheap_stats st;
+  lheap_get_stats(&st);
+  lval *x = lval_qexpr();
+  lval_add(x, lval_num(st.objects));
+  lval_add(x, lval_num(st.bytes));
+  lval_add(x, lval_num(st.collections));
+  lval_add(x, lval_num(st.freed));
+  lval_add(x, lval_num(st.last_pause_us));
+  lval_add(x, lval_num(st.max_pause_us));
+  lval_add(x, lval_num(st.total_pause_us));
+  return x;
+}
+
+lval *builtin_pools(lenv *e, lval *a) {
+  LASSERT_NUM("pools", a, 1);
+  lval_del(a);
+
+  /* One {cell-size slabs live free allocs frees} entry per object kind */
+  lval *x = lval_qexpr();
+  for (int k = 0; k < LOBJ_KINDS; k++) {
+    lpool *p = &lheap.pools[k];
+    lval *y = lval_qexpr();
+    lval_add(y, lval_num(p->size));
+    lval_add(y, lval_num(p->nslabs));
+    lval_add(y, lval_num(p->nslabs * LSLAB_CELLS - p->nfree));
+    lval_add(y, lval_num(p->nfree));
+    lval_add(y, lval_num(p->allocs));
+    lval_add(y, lval_num(p->frees));
+    lval_add(x, y);
   }
+  return x;
+}
 
+lval *builtin_gc(lenv *e, lval *a) {
+  LASSERT_NUM("gc", a, 1);
   lval_del(a);
+
+  /* Collection can only happen once the current form has finished */
+  lheap.requested = 1;
   return lval_sexpr();
 }
 
-lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
+lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, lsym_def); }
 
-lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
+lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, lsym_put); }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
   lval *k = lval_sym(name);
@@ -690,6 +3861,15 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
   lval_del(v);
 }
 
+void lenv_add_special(lenv *e, char *name, lbuiltin func) {
+  lval *k = lval_sym(name);
+  lval *v = lval_builtin(func);
+  v->special = 1;
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
 void lenv_add_builtins(lenv *e) {
   /* Variable Functions */
   lenv_add_builtin(e, "\\", builtin_lambda);
@@ -700,7 +3880,8 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "list", builtin_list);
   lenv_add_builtin(e, "head", builtin_head);
   lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_special(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
 
   /* Mathematical Functions */
@@ -709,6 +3890,30 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
 
+  /* Vector Functions */
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "unvec", builtin_unvec);
+  lenv_add_builtin(e, "sum", builtin_sum);
+  lenv_add_builtin(e, "prod", builtin_prod);
+  lenv_add_builtin(e, "min", builtin_min);
+  lenv_add_builtin(e, "max", builtin_max);
+  lenv_add_builtin(e, "dot", builtin_dot);
+
+  /* Map Functions */
+  lenv_add_builtin(e, "hash-map", builtin_hash_map);
+  lenv_add_builtin(e, "get", builtin_get);
+  lenv_add_builtin(e, "has", builtin_has);
+  lenv_add_builtin(e, "assoc", builtin_assoc);
+  lenv_add_builtin(e, "dissoc", builtin_dissoc);
+  lenv_add_builtin(e, "keys", builtin_keys);
+  lenv_add_builtin(e, "vals", builtin_vals);
+
+  /* String Functions */
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "substr", builtin_substr);
+  lenv_add_builtin(e, "find", builtin_find);
+  lenv_add_builtin(e, "split", builtin_split);
+
   /* Logic Functions */
   lenv_add_builtin(e, ">", builtin_gt);
   lenv_add_builtin(e, "<", builtin_lt);
@@ -719,250 +3924,962 @@ void lenv_add_builtins(lenv *e) {
 
   /* Conditionals */
 
-  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_special(e, "if", builtin_if);
+
+  /* Memory Functions */
+  lenv_add_builtin(e, "heap", builtin_heap);
+  lenv_add_builtin(e, "pools", builtin_pools);
+  lenv_add_builtin(e, "gc", builtin_gc);
+
+  /* File Functions */
+  lenv_add_builtin(e, "load", builtin_load);
 }
 
 /* Evaluation */
 
-lval *lval_call(lenv *e, lval *f, lval *a) {
+/* Bind arguments 'a' to the formals of lambda 'f', taking ownership of
+ * 'a'. Once every formal is bound returns NULL, with '*frame' set to the
+ * environment to run the body in. Otherwise returns the partially applied
+ * function or an error. Either way 'f' itself is left untouched. */
+lval *lval_bind(lval *f, lval *a, lenv **frame) {
 
-  /* If Builtin then simply apply that */
-  if (f->builtin) {
-    return f->builtin(e, a);
-  }
+  /* Arguments go into a fresh frame sharing everything 'f' captured */
+  lenv *x = lenv_copy(f->env);
+  lval *formals = f->formals;
+
+  /* Unbound formals are always the last of the function's scope */
+  int base = x->scope->count - formals->count;
 
   /* Record Argument Counts */
   int given = a->count;
-  int total = f->formals->count;
+  int total = formals->count;
 
-  /* While arguments still remain to be processed */
-  while (a->count) {
+  /* Walk formals and arguments in step, leaving both lists in place */
+  int i = 0;
+  int j = 0;
+  while (j < a->count) {
 
     /* If we've ran out of formal arguments to bind */
-    if (f->formals->count == 0) {
+    if (i == formals->count) {
+      lenv_del(x);
       lval_del(a);
       return lval_err("Function passed too many arguments. "
                       "Got %i, Expected %i.",
                       given, total);
     }
 
-    /* Pop the first symbol from the formals */
-    lval *sym = lval_pop(f->formals, 0);
+    lval *sym = formals->cell[i++];
 
     /* Special Case to deal with '&' */
-    if (strcmp(sym->sym, "&") == 0) {
+    if (sym->sym == lsym_amp) {
 
       /* Ensure '&' is followed by another symbol */
-      if (f->formals->count != 1) {
+      if (i != formals->count - 1) {
+        lenv_del(x);
         lval_del(a);
         return lval_err("Function format invalid. "
                         "Symbol '&' not followed by single symbol.");
       }
 
       /* Next formal should be bound to remaining arguments */
-      lval *nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
+      lval *rest = lval_slice(a, j, a->count - j);
+      j = a->count;
+      lenv_set_local(x, base + i, rest);
+      lval_del(rest);
+      i++;
       break;
     }
 
-    /* Pop the next argument from the list */
-    lval *val = lval_pop(a, 0);
-
-    /* Bind a copy into the function's environment */
-    lenv_put(f->env, sym, val);
-
-    /* Delete symbol and value */
-    lval_del(sym);
-    lval_del(val);
+    /* Bind the next argument into the new frame */
+    lenv_set_local(x, base + i - 1, a->cell[j++]);
   }
 
   /* Argument list is now bound so can be cleaned up */
   lval_del(a);
 
   /* If '&' remains in formal list bind to empty list */
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+  if (i < formals->count && formals->cell[i]->sym == lsym_amp) {
 
     /* Check to ensure that & is not passed invalidly. */
-    if (f->formals->count != 2) {
+    if (formals->count - i != 2) {
+      lenv_del(x);
       return lval_err("Function format invalid. "
                       "Symbol '&' not followed by single symbol.");
     }
 
-    /* Pop and delete '&' symbol */
-    lval_del(lval_pop(f->formals, 0));
-
-    /* Pop next symbol and create empty list */
-    lval *sym = lval_pop(f->formals, 0);
     lval *val = lval_qexpr();
-
-    /* Bind to environment and delete */
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
+    lenv_set_local(x, base + i + 1, val);
     lval_del(val);
+    i += 2;
   }
 
-  /* If all formals have been bound evaluate */
-  if (f->formals->count == 0) {
-
-    /* Set environment parent to evaluation environment */
-    f->env->par = e;
+  if (i == formals->count) {
+    *frame = x;
+    return NULL;
+  }
 
-    /* Evaluate and return */
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+  /* A partial application keeps only the formals still unbound */
+  lval *p = lval_alloc();
+  p->type = LVAL_FUN;
+  p->builtin = NULL;
+  p->env = x;
+  p->body = lval_ref(f->body);
+  if (i == 0) {
+    p->formals = lval_ref(formals);
   } else {
-    /* Otherwise return partially evaluated function */
-    return lval_copy(f);
+    p->formals = lval_slice(formals, i, formals->count - i);
   }
+  return p;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
+/* Virtual Machine */
 
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+/* Code for running 'x' in 'e' */
+lcode *lval_code(lval *x, lenv *e) {
+  /* Compile on first use, later copies of 'x' share the result */
+  if (!x->code) {
+    x->code = lcode_new();
+  }
+  lcode *c = x->code;
+  if (!c->ops) {
+    lcode_compile(c, x, e);
+    return c;
+  }
+
+  /* Reuse a variant compiled for the same scopes, or add one */
+  while (!lcode_fits(c, e)) {
+    if (!c->alt) {
+      c->alt = lcode_new();
+      lcode_compile(c->alt, x, e);
+    }
+    c = c->alt;
+  }
+  return c;
+}
+
+void lvm_push(lvm *vm, lval *x) {
+  if (vm->sp == vm->scap) {
+    vm->scap = vm->scap ? vm->scap * 2 : 64;
+    vm->stack = realloc(vm->stack, sizeof(lval *) * vm->scap);
+  }
+  vm->stack[vm->sp++] = x;
+}
+
+/* Start running the code of 'x' in 'e'. A tail call replaces the current
+ * frame, which has nothing left to do, so loops run in constant space. */
+void lvm_enter(lvm *vm, lenv *e, lval *x, int tail) {
+  lframe f = {lenv_ref(e), lcode_ref(lval_code(x, e)), 0};
+
+  if (tail) {
+    lframe *old = &vm->frames[vm->nframes - 1];
+    lenv_del(old->env);
+    lcode_del(old->code);
+    *old = f;
+    return;
+  }
+
+  if (vm->nframes == vm->fcap) {
+    vm->fcap = vm->fcap ? vm->fcap * 2 : 16;
+    vm->frames = realloc(vm->frames, sizeof(lframe) * vm->fcap);
   }
+  vm->frames[vm->nframes++] = f;
+}
+
+/* Apply the evaluated S-Expression 'v', either pushing its value or
+ * entering the code it calls */
+void lvm_apply(lvm *vm, lenv *e, lval *v, int tail) {
 
   for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+    if (ltype(v->cell[i]) == LVAL_ERR) {
+      lvm_push(vm, lval_take(v, i));
+      return;
     }
   }
 
   if (v->count == 0) {
-    return v;
+    lvm_push(vm, v);
+    return;
   }
   if (v->count == 1) {
-    return lval_eval(e, lval_take(v, 0));
+    lvm_push(vm, lval_eval(e, lval_take(v, 0)));
+    return;
   }
 
   lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
+  if (ltype(f) != LVAL_FUN) {
     lval *err = lval_err("S-Expression starts with incorrect type. "
                          "Got %s, Expected %s.",
-                         ltype_name(f->type), ltype_name(LVAL_FUN));
+                         ltype_name(ltype(f)), ltype_name(LVAL_FUN));
     lval_del(f);
     lval_del(v);
-    return err;
+    lvm_push(vm, err);
+    return;
+  }
+
+  /* Builtins simply apply, special ones hand back code to run here */
+  if (f->builtin) {
+    lval *x = f->builtin(e, v);
+    int special = f->special;
+    lval_del(f);
+    if (!special || ltype(x) == LVAL_ERR) {
+      lvm_push(vm, x);
+      return;
+    }
+    lvm_enter(vm, e, x, tail);
+    lval_del(x);
+    return;
+  }
+
+  /* Partially applied functions are values in their own right */
+  lenv *frame;
+  lval *p = lval_bind(f, v, &frame);
+  if (p) {
+    lval_del(f);
+    lvm_push(vm, p);
+    return;
   }
 
-  lval *result = lval_call(e, f, v);
+  lvm_enter(vm, frame, f->body, tail);
+  lenv_del(frame);
   lval_del(f);
-  return result;
 }
 
+lval *lvm_run(lenv *e, lval *x) {
+  lvm vm = {lvm_top, 0, 0, NULL, 0, 0, NULL};
+  lvm_top = &vm;
+  lvm_enter(&vm, e, x, 0);
+
+  while (1) {
+    lframe *f = &vm.frames[vm.nframes - 1];
+    lval **consts = f->code->consts;
+    int *ops = f->code->ops;
+
+    switch (ops[f->pc++]) {
+    case OP_CONST:
+      lvm_push(&vm, lval_ref(consts[ops[f->pc++]]));
+      break;
+    case OP_LOAD:
+      lvm_push(&vm, lenv_get(f->env, consts[ops[f->pc++]]));
+      break;
+    case OP_LOCAL: {
+      int depth = ops[f->pc++];
+      int slot = ops[f->pc++];
+      lval *k = consts[ops[f->pc++]];
+
+      /* Bindings made by name on the way up may shadow the local */
+      lenv *x = f->env;
+      int named = 0;
+      for (int i = 0; i < depth; i++) {
+        named |= x->count;
+        x = x->par;
+      }
+      lval *v = x->locals[slot];
+      lvm_push(&vm, v && !named ? lval_ref(v) : lenv_get(f->env, k));
+      break;
+    }
+    case OP_SEXPR: {
+      /* Gather the evaluated children into an S-Expression and apply it */
+      int n = ops[f->pc++];
+      lval *v = lval_sexpr();
+      if (n) {
+        lval_reserve(v, n);
+        v->count = n;
+        v->seq->used = n;
+        memcpy(v->cell, &vm.stack[vm.sp - n], sizeof(lval *) * n);
+        vm.sp -= n;
+      }
+      lvm_apply(&vm, f->env, v, ops[f->pc] == OP_RET);
+      break;
+    }
+    case OP_RET: {
+      /* The result stays on the stack for the calling frame */
+      lenv_del(f->env);
+      lcode_del(f->code);
+      vm.nframes--;
+      if (vm.nframes == 0) {
+        lval *r = vm.stack[--vm.sp];
+        free(vm.stack);
+        free(vm.frames);
+        lvm_top = vm.prev;
+        return r;
+      }
+      break;
+    }
+    }
+  }
+}
+
+/* Evaluate Q-Expression 'x' as code in 'e' */
+lval *lval_run(lenv *e, lval *x) { return lvm_run(e, x); }
+
 lval *lval_eval(lenv *e, lval *v) {
-  if (v->type == LVAL_SYM) {
+  if (ltype(v) == LVAL_SYM) {
     lval *x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(e, v);
+  if (ltype(v) == LVAL_SEXPR) {
+    lval *x = lval_run(e, v);
+    lval_del(v);
+    return x;
   }
   return v;
 }
 
 /* Reading */
 
-lval *lval_read_num(mpc_ast_t *t) {
+lval *lval_read_num(char *s) {
+  if (strpbrk(s, ".eE")) {
+    return lval_flo(strtod(s, NULL));
+  }
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
+  long x = strtol(s, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_big(lbig_read(s));
+}
+
+lval *lval_read_sym(char *s) {
+  if (strcmp(s, "true") == 0) {
+    return lval_bool(1);
+  }
+  if (strcmp(s, "false") == 0) {
+    return lval_bool(0);
+  }
+  return lval_sym(s);
+}
+
+/* Unescape the 'n' bytes between the quotes of a string literal */
+lval *lval_read_str(char *p, long n) {
+  lval *x = lval_str_window(lstr_new(n), 0, 0);
+  char *out = x->str->data;
+  for (long i = 0; i < n; i++) {
+    char *esc;
+    if (p[i] == '\\' && i + 1 < n &&
+        (esc = strchr(lesc_names, p[i + 1])) && *esc) {
+      out[x->len++] = lesc_bytes[esc - lesc_names];
+      i++;
+    } else {
+      out[x->len++] = p[i];
+    }
+  }
+  x->str->used = x->len;
+  return x;
+}
+
+/* Folds for the mpc parsers in main, building lvals as they go */
+
+mpc_val_t *lread_apply_num(mpc_val_t *x) {
+  lval *v = lval_read_num(x);
+  free(x);
+  return v;
+}
+
+mpc_val_t *lread_apply_sym(mpc_val_t *x) {
+  lval *v = lval_read_sym(x);
+  free(x);
+  return v;
+}
+
+mpc_val_t *lread_apply_str(mpc_val_t *x) {
+  lval *v = lval_read_str((char *)x + 1, strlen(x) - 2);
+  free(x);
+  return v;
+}
+
+mpc_val_t *lread_fold_many(int n, mpc_val_t **xs) {
+  lval *x = lval_sexpr();
+  lval_reserve(x, n);
+  for (int i = 0; i < n; i++) {
+    x = lval_add(x, xs[i]);
+  }
+  return x;
+}
+
+/* Keep the expressions between the brackets */
+mpc_val_t *lread_fold_sexpr(int n, mpc_val_t **xs) {
+  free(xs[0]);
+  free(xs[2]);
+  return xs[1];
+}
+
+mpc_val_t *lread_fold_qexpr(int n, mpc_val_t **xs) {
+  lval *x = lread_fold_sexpr(n, xs);
+  x->type = LVAL_QEXPR;
+  return x;
+}
+
+/* Reader */
+
+/* Reads source straight into lvals in one pass, accepting exactly the
+ * language of the grammar in main. It gives up with NULL on anything the
+ * grammar would reject, leaving mpc to describe the error. */
+
+typedef struct lreader {
+  char *p;
+  char *end;
+
+  /* NUL terminated copy of the current number or symbol */
+  char *tok;
+  long cap;
+} lreader;
+
+int lread_space(int c) { return c && strchr(" \f\n\r\t\v", c); }
+
+int lread_digit(int c) { return c >= '0' && c <= '9'; }
+
+int lread_symchar(int c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         lread_digit(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+void lread_skip(lreader *r) {
+  while (r->p < r->end && lread_space(*r->p)) {
+    r->p++;
+  }
+}
+
+/* Copy the token from 's' up to the read position into 'tok' */
+char *lread_token(lreader *r, char *s) {
+  long n = r->p - s;
+  if (n + 1 > r->cap) {
+    r->cap = (n + 1) * 2;
+    r->tok = realloc(r->tok, r->cap);
+  }
+  memcpy(r->tok, s, n);
+  r->tok[n] = '\0';
+  return r->tok;
 }
 
-lval *lval_read(mpc_ast_t *t) {
+lval *lread_expr(lreader *r);
 
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
+/* Step over one of the spellings of infinity or NaN, '+inf.0' and the
+ * like, which cannot be symbols as they contain a point */
+int lread_special(lreader *r) {
+  if (r->end - r->p < 6 || (r->p[0] != '+' && r->p[0] != '-')) {
+    return 0;
+  }
+  if (memcmp(r->p + 1, "inf.0", 5) && memcmp(r->p + 1, "nan.0", 5)) {
+    return 0;
   }
-  if (strstr(t->tag, "symbol")) {
-    if (strcmp(t->contents, "true") == 0) {
-      return lval_bool(1);
+  r->p += 6;
+  return 1;
+}
+
+/* Read expressions up to 'close', or to the end of input if it is NUL */
+lval *lread_list(lreader *r, lval *x, char close) {
+  while (1) {
+    lread_skip(r);
+    if (r->p == r->end) {
+      if (close) {
+        lval_del(x);
+        return NULL;
+      }
+      return x;
+    }
+    if (*r->p == close) {
+      r->p++;
+      return x;
     }
+    lval *y = lread_expr(r);
+    if (!y) {
+      lval_del(x);
+      return NULL;
+    }
+    x = lval_add(x, y);
+  }
+}
 
-    if (strcmp(t->contents, "false") == 0) {
-      return lval_bool(0);
+lval *lread_expr(lreader *r) {
+  char *s = r->p;
+  char c = *s;
+  int more = s + 1 < r->end;
+
+  /* Numbers are tried before symbols, as in the grammar */
+  if (lread_special(r)) {
+    return lval_read_num(lread_token(r, s));
+  }
+  if (lread_digit(c) || (c == '-' && more && lread_digit(s[1]))) {
+    r->p++;
+    while (r->p < r->end && lread_digit(*r->p)) {
+      r->p++;
+    }
+    if (r->end - r->p > 1 && r->p[0] == '.' && lread_digit(r->p[1])) {
+      r->p++;
+      while (r->p < r->end && lread_digit(*r->p)) {
+        r->p++;
+      }
     }
+    if (r->end - r->p > 1 && (r->p[0] == 'e' || r->p[0] == 'E')) {
+      char *q = r->p + 1;
+      q += q + 1 < r->end && (*q == '+' || *q == '-');
+      if (q < r->end && lread_digit(*q)) {
+        r->p = q;
+        while (r->p < r->end && lread_digit(*r->p)) {
+          r->p++;
+        }
+      }
+    }
+    return lval_read_num(lread_token(r, s));
+  }
 
-    return lval_sym(t->contents);
+  if (lread_symchar(c)) {
+    while (r->p < r->end && lread_symchar(*r->p)) {
+      r->p++;
+    }
+    return lval_read_sym(lread_token(r, s));
   }
 
-  lval *x = NULL;
-  if (strcmp(t->tag, ">") == 0) {
-    x = lval_sexpr();
+  if (c == '"') {
+    r->p++;
+    while (r->p < r->end && *r->p != '"') {
+      r->p += *r->p == '\\' && r->end - r->p > 1 ? 2 : 1;
+    }
+    if (r->p == r->end) {
+      return NULL;
+    }
+    r->p++;
+    return lval_read_str(s + 1, r->p - s - 2);
   }
-  if (strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
+
+  if (c == '(') {
+    r->p++;
+    return lread_list(r, lval_sexpr(), ')');
   }
-  if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
+  if (c == '{') {
+    r->p++;
+    return lread_list(r, lval_qexpr(), '}');
   }
+  return NULL;
+}
 
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) {
-      continue;
+/* Read every expression in the 'n' bytes at 's' into an S-Expression,
+ * or NULL if they are not valid Lispy */
+lval *lval_read_all(char *s, long n) {
+  lreader r = {s, s + n, NULL, 0};
+  lval *x = lread_list(&r, lval_sexpr(), '\0');
+  free(r.tok);
+  return x;
+}
+
+/* Loading */
+
+mpc_parser_t *Lispy;
+
+/* Errors reported while running files or streams, for the exit status */
+long lerrors = 0;
+
+/* Map the file at 'path' read only, setting '*n' to its length. Returns
+ * NULL with errno set on failure. */
+char *lfile_map(char *path, long *n) {
+#ifdef _WIN32
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *p = malloc(*n ? *n : 1);
+  *n = fread(p, 1, *n, f);
+  fclose(f);
+  return p;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  /* Empty files cannot be mapped */
+  *n = st.st_size;
+  char *p = *n ? mmap(NULL, *n, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+void lfile_unmap(char *p, long n) {
+#ifdef _WIN32
+  free(p);
+#else
+  if (n) {
+    munmap(p, n);
+  }
+#endif
+}
+
+/* A position in a source, counted from zero as mpc does */
+typedef struct lpos {
+  long row;
+  long col;
+} lpos;
+
+/* The position 'at' moved on past the 'n' bytes at 'p' */
+lpos lpos_skip(lpos at, char *p, long n) {
+  char *end = p + n;
+  char *nl;
+  while ((nl = memchr(p, '\n', end - p))) {
+    at.row++;
+    at.col = 0;
+    p = nl + 1;
+  }
+  at.col += end - p;
+  return at;
+}
+
+/* Read the 'n' bytes at 'p', which start at 'at' in 'name', into an
+ * S-Expression of forms. Returns NULL if they are not valid Lispy, with
+ * '*err' set to mpc's description; '*err' is NULL whenever a result is
+ * returned. */
+lval *lval_parse(char *name, char *p, long n, lpos at, char **err) {
+  *err = NULL;
+  lval *forms = lval_read_all(p, n);
+  if (forms) {
+    return forms;
+  }
+
+  mpc_result_t r;
+  if (mpc_nparse(name, p, n, Lispy, &r)) {
+    return r.output;
+  }
+
+  /* mpc counts from the start of 'p', which may be partway into 'name' */
+  if (r.error->state.row == 0) {
+    r.error->state.col += at.col;
+  }
+  r.error->state.row += at.row;
+  *err = mpc_err_string(r.error);
+  (*err)[strcspn(*err, "\n")] = '\0';
+  mpc_err_delete(r.error);
+  return NULL;
+}
+
+/* Evaluate and delete each of 'forms' in turn, printing every result
+ * with 'echo' set and only errors otherwise. With 'safepoints' set the
+ * heap may be collected between forms, which is only safe when called
+ * from the top level. */
+void lval_eval_all(lenv *e, lval *forms, int echo, int safepoints) {
+
+  /* Forms still to run must survive any collection */
+  lheap_add_root(forms);
+  while (forms->count) {
+    lval *x = lval_eval(e, lval_pop(forms, 0));
+    lerrors += ltype(x) == LVAL_ERR;
+    if (echo || ltype(x) == LVAL_ERR) {
+      lval_println(x);
     }
-    if (strcmp(t->children[i]->contents, ")") == 0) {
-      continue;
+    lval_del(x);
+    if (safepoints) {
+      lheap_safepoint();
     }
-    if (strcmp(t->children[i]->contents, "}") == 0) {
+  }
+  lheap_del_root(forms);
+  lval_del(forms);
+}
+
+/* Finds where top level forms end in input that arrives a piece at a
+ * time. The state carries over between pieces so nothing is scanned
+ * twice. A form ends at its closing bracket or quote, or for a bare
+ * token at the whitespace after it. */
+typedef struct lscan {
+  int depth;
+  int str;
+  int esc;
+  int atom;
+} lscan;
+
+/* Length of the 'n' bytes at 'p' up to the end of the next form, or -1
+ * if no form ends within them */
+long lscan_next(lscan *s, char *p, long n) {
+  for (long i = 0; i < n; i++) {
+    char c = p[i];
+    if (s->str) {
+      if (s->esc) {
+        s->esc = 0;
+      } else if (c == '\\') {
+        s->esc = 1;
+      } else if (c == '"') {
+        s->str = 0;
+        if (!s->depth) {
+          return i + 1;
+        }
+      }
       continue;
     }
-    if (strcmp(t->children[i]->contents, "{") == 0) {
+
+    if (lread_space(c)) {
+      if (s->atom) {
+        s->atom = 0;
+        return i;
+      }
       continue;
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+
+    switch (c) {
+    case '"':
+      s->str = 1;
+      s->atom = 0;
+      break;
+    case '(':
+    case '{':
+      s->depth++;
+      s->atom = 0;
+      break;
+    case ')':
+    case '}':
+      /* A stray close ends a form too, which the reader then rejects */
+      s->atom = 0;
+      if (--s->depth <= 0) {
+        s->depth = 0;
+        return i + 1;
+      }
+      break;
+    default:
+      s->atom = !s->depth;
     }
-    x = lval_add(x, lval_read(t->children[i]));
   }
+  return -1;
+}
 
-  return x;
+/* Whether a form is left open after scanning on through 'n' bytes */
+int lscan_open(lscan *s, char *p, long n) {
+  long i = 0;
+  long k;
+  while ((k = lscan_next(s, p + i, n - i)) >= 0) {
+    i += k;
+  }
+  return s->depth > 0 || s->str;
+}
+
+/* Evaluate each form in the file at 'path' in turn, printing any errors
+ * or with 'echo' set every result. Forms before a syntax error have
+ * already run when it is reported. */
+lval *lval_load(lenv *e, char *path, int echo, int safepoints) {
+  long n;
+  char *src = lfile_map(path, &n);
+  if (!src) {
+    return lval_err("Could not load file '%s'. %s", path, strerror(errno));
+  }
+
+  /* The reader works on the mapping directly, copying only tokens. Each
+   * form runs as soon as it is read, so only one is held at a time
+   * however large the file. */
+  lscan s = {0, 0, 0, 0};
+  lpos at = {0, 0};
+  long start = 0;
+  while (start < n) {
+    long k = lscan_next(&s, src + start, n - start);
+    long end = k < 0 ? n : start + k;
+    char *msg;
+    lval *forms = lval_parse(path, src + start, end - start, at, &msg);
+    if (!forms) {
+      lval *err = lval_err("Could not load file. %s", msg);
+      free(msg);
+      lfile_unmap(src, n);
+      return err;
+    }
+    lval_eval_all(e, forms, echo, safepoints);
+    at = lpos_skip(at, src + start, end - start);
+    start = end;
+  }
+  lfile_unmap(src, n);
+  return lval_sexpr();
+}
+
+/* Streaming */
+
+/* Bytes read from a stream at a time */
+#define LSTREAM_CHUNK 65536
+
+/* Run the form in the 'n' bytes at 'p', which start at 'at' in stdin */
+void lstream_run(lenv *e, char *p, long n, lpos at) {
+  char *msg;
+  lval *forms = lval_parse("<stdin>", p, n, at, &msg);
+  if (!forms) {
+    puts(msg);
+    free(msg);
+    lerrors++;
+    return;
+  }
+  lval_eval_all(e, forms, 1, 1);
+}
+
+/* Evaluate forms from stdin as soon as each one closes, printing their
+ * results. Only the form being read is kept, so memory stays bounded
+ * however much input arrives. With 'flush' set output is flushed before
+ * waiting for more input. Must be called from the top level. */
+void lval_stream(lenv *e, int flush) {
+  long cap = LSTREAM_CHUNK * 2;
+  char *buf = malloc(cap);
+  long len = 0;
+  long start = 0;
+  long scan = 0;
+  lscan s = {0, 0, 0, 0};
+
+  /* Where the unrun input starts in the stream, for error positions */
+  lpos at = {0, 0};
+
+  while (1) {
+    long k;
+    while ((k = lscan_next(&s, buf + scan, len - scan)) >= 0) {
+      scan += k;
+      lstream_run(e, buf + start, scan - start, at);
+      at = lpos_skip(at, buf + start, scan - start);
+      start = scan;
+    }
+    scan = len;
+
+    /* Drop what has been run, then read the next chunk */
+    memmove(buf, buf + start, len - start);
+    len -= start;
+    scan -= start;
+    start = 0;
+    if (len + LSTREAM_CHUNK > cap) {
+      cap = (len + LSTREAM_CHUNK) * 2;
+      buf = realloc(buf, cap);
+    }
+
+    /* Results reach a waiting reader before this blocks for more input */
+    if (flush) {
+      fflush(stdout);
+    }
+
+#ifdef _WIN32
+    long got = fread(buf + len, 1, LSTREAM_CHUNK, stdin);
+#else
+    /* read returns whatever a pipe has rather than waiting to fill */
+    long got = read(STDIN_FILENO, buf + len, LSTREAM_CHUNK);
+#endif
+    if (got <= 0) {
+      break;
+    }
+    len += got;
+  }
+
+  /* Whatever is left at the end of input is the last form */
+  if (len > 0) {
+    lstream_run(e, buf, len, at);
+  }
+  free(buf);
 }
 
 /* Main */
 
+/* Size of the stdout buffer in batch mode */
+#define LBATCH_BUFFER (1 << 20)
+
 int main(int argc, char **argv) {
 
   mpc_parser_t *Number = mpc_new("number");
   mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
   mpc_parser_t *Sexpr = mpc_new("sexpr");
   mpc_parser_t *Qexpr = mpc_new("qexpr");
   mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Lispy = mpc_new("lispy");
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                     \
-      number : /-?[0-9]+/ ;                               \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
-      sexpr  : '(' <expr>* ')' ;                          \
-      qexpr  : '{' <expr>* '}' ;                          \
-      expr   : <number> | <symbol> | <sexpr> | <qexpr> ;  \
-      lispy  : /^/ <expr>* /$/ ;                          \
-    ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-  puts("Lispy Version 0.0.0.0.8");
-  puts("Press Ctrl+c to Exit\n");
+  Lispy = mpc_new("lispy");
+
+  /* The grammar is built from combinators rather than mpca_lang, so a
+   * parse yields lvals directly instead of an AST */
+  mpc_dtor_t del = (mpc_dtor_t)lval_del;
+  mpc_define(Number, mpc_apply(mpc_tok(mpc_re("[+-](inf|nan)\\.0|"
+                                              "-?[0-9]+(\\.[0-9]+)?"
+                                              "([eE][+-]?[0-9]+)?")),
+                               lread_apply_num));
+  mpc_define(Symbol,
+             mpc_apply(mpc_tok(mpc_re("[a-zA-Z0-9_+\\-*/\\\\=<>!&]+")),
+                       lread_apply_sym));
+  mpc_define(String, mpc_apply(mpc_tok(mpc_re("\"(\\\\.|[^\"])*\"")),
+                               lread_apply_str));
+  mpc_define(Sexpr, mpc_and(3, lread_fold_sexpr, mpc_tok(mpc_char('(')),
+                            mpc_many(lread_fold_many, Expr),
+                            mpc_tok(mpc_char(')')), free, del));
+  mpc_define(Qexpr, mpc_and(3, lread_fold_qexpr, mpc_tok(mpc_char('{')),
+                            mpc_many(lread_fold_many, Expr),
+                            mpc_tok(mpc_char('}')), free, del));
+  mpc_define(Expr, mpc_or(5, Number, Symbol, String, Sexpr, Qexpr));
+  mpc_define(Lispy, mpc_and(3, lread_fold_sexpr, mpc_tok(mpc_re("^")),
+                            mpc_many(lread_fold_many, Expr),
+                            mpc_tok(mpc_re("$")), free, del));
+
+  lsym_init();
 
   lenv *e = lenv_new();
   lenv_add_builtins(e);
+  lheap_add_root(e);
+
+  /* In batch mode every result is printed through a large buffer, which
+   * is only flushed when full or at exit */
+  int batch = argc > 1 && strcmp(argv[1], "-b") == 0;
+  if (batch) {
+    setvbuf(stdout, NULL, _IOFBF, LBATCH_BUFFER);
+    if (argc == 2) {
+      lval_stream(e, 0);
+    }
+  }
 
-  while (1) {
+  /* Files named on the command line are run in order instead of the REPL,
+   * with '-' streaming forms from stdin */
+  for (int i = 1 + batch; i < argc; i++) {
+    if (strcmp(argv[i], "-") == 0) {
+      lval_stream(e, !batch);
+      continue;
+    }
+    lval *x = lval_load(e, argv[i], batch, 1);
+    if (ltype(x) == LVAL_ERR) {
+      lval_println(x);
+      lerrors++;
+    }
+    lval_del(x);
+  }
+
+  if (argc == 1) {
+    puts("Lispy Version 0.0.0.0.8");
+    puts("Press Ctrl+c to Exit\n");
+  }
+
+  while (argc == 1) {
 
     char *input = readline("lispy> ");
+    if (!input) {
+      break;
+    }
     add_history(input);
 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval *x = lval_eval(e, lval_read(r.output));
+    /* Keep reading lines while a form is left open */
+    long n = strlen(input);
+    lscan s = {0, 0, 0, 0};
+    int open = lscan_open(&s, input, n);
+    while (open) {
+      char *more = readline("  ...> ");
+      if (!more) {
+        break;
+      }
+      add_history(more);
+      long m = strlen(more);
+      input = realloc(input, n + m + 2);
+      input[n] = '\n';
+      memcpy(input + n + 1, more, m + 1);
+      open = lscan_open(&s, input + n, m + 1);
+      n += m + 1;
+      free(more);
+    }
+
+    char *msg;
+    lpos at = {0, 0};
+    lval *x = lval_parse("<stdin>", input, n, at, &msg);
+    if (!x) {
+      puts(msg);
+      free(msg);
+    }
+
+    if (x) {
+      x = lval_eval(e, x);
       lval_println(x);
       lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      lheap_safepoint();
     }
 
     free(input);
@@ -970,7 +4887,8 @@ int main(int argc, char **argv) {
 
   lenv_del(e);
 
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
 
-  return 0;
+  /* Non-zero if anything run from a file or stream failed */
+  return lerrors ? 1 : 0;
 }